@@ -0,0 +1,490 @@
+
+/////////////////////////////////////////////////////////////////////////////// 
+// 
+// Copyright (c) 2016 Herb Sutter. All rights reserved. 
+// 
+// This code is licensed under the MIT License (MIT). 
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+// THE SOFTWARE. 
+// 
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//	Benchmarks, using Google Benchmark (https://github.com/google/benchmark).
+//	Build with optimizations and link with -lbenchmark -lpthread; then, e.g.,
+//
+//		bench --benchmark_repetitions=10 --benchmark_format=json
+//
+//	reports the mean, median and standard deviation of each benchmark in a
+//	form that can be compared across commits (see benchmark's tools/compare.py).
+//
+//----------------------------------------------------------------------------
+
+#include "deferred_allocator.h"
+#include "deferred_span.h"
+#include "gpage_resource.h"
+using namespace gcpp;
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <vector>
+#include <list>
+#include <set>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+using namespace std;
+
+
+//----------------------------------------------------------------------------
+//
+//	make<T> compared with make_shared<T>, N objects per iteration. The heap
+//	is collected (untimed) between iterations so that it doesn't keep growing.
+//
+//----------------------------------------------------------------------------
+
+template<class T>
+void bm_make_shared(benchmark::State& state) {
+	vector<shared_ptr<T>> v;
+	v.reserve(state.range(0));
+	for (auto _ : state) {
+		for (auto i = 0; i < state.range(0); ++i) {
+			v.push_back(make_shared<T>());
+		}
+		state.PauseTiming();
+		v.clear();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template<class T>
+void bm_make_deferred(benchmark::State& state) {
+	deferred_heap heap;
+	vector<deferred_ptr<T>> v;
+	v.reserve(state.range(0));
+	for (auto _ : state) {
+		for (auto i = 0; i < state.range(0); ++i) {
+			v.push_back(heap.make<T>());
+		}
+		state.PauseTiming();
+		v.clear();
+		heap.collect();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK_TEMPLATE(bm_make_shared, int)->Range(8, 8 << 10);
+BENCHMARK_TEMPLATE(bm_make_deferred, int)->Range(8, 8 << 10);
+
+
+//----------------------------------------------------------------------------
+//
+//	Copying, moving and destroying pointers, outside and inside the heap
+//	(a deferred_ptr is registered as a root or as an interior pointer).
+//
+//----------------------------------------------------------------------------
+
+void bm_shared_ptr_copy(benchmark::State& state) {
+	auto p = make_shared<int>(42);
+	for (auto _ : state) {
+		auto q = p;		// copy, then destroy
+		benchmark::DoNotOptimize(q);
+	}
+}
+BENCHMARK(bm_shared_ptr_copy);
+
+void bm_deferred_ptr_copy(benchmark::State& state) {
+	deferred_heap heap;
+	auto p = heap.make<int>(42);
+	for (auto _ : state) {
+		auto q = p;		// copy, then destroy
+		benchmark::DoNotOptimize(q);
+	}
+}
+BENCHMARK(bm_deferred_ptr_copy);
+
+void bm_shared_ptr_move(benchmark::State& state) {
+	auto p = make_shared<int>(42);
+	for (auto _ : state) {
+		auto q = std::move(p);
+		p = std::move(q);
+		benchmark::DoNotOptimize(p);
+	}
+}
+BENCHMARK(bm_shared_ptr_move);
+
+void bm_deferred_ptr_move(benchmark::State& state) {
+	deferred_heap heap;
+	auto p = heap.make<int>(42);
+	for (auto _ : state) {
+		auto q = std::move(p);
+		p = std::move(q);
+		benchmark::DoNotOptimize(p);
+	}
+}
+BENCHMARK(bm_deferred_ptr_move);
+
+void bm_deferred_ptr_assign(benchmark::State& state) {
+	deferred_heap heap;
+	auto p = heap.make<int>(1);
+	auto q = heap.make<int>(2);
+	auto r = p;
+	for (auto _ : state) {
+		r = q;
+		r = p;
+		benchmark::DoNotOptimize(r);
+	}
+}
+BENCHMARK(bm_deferred_ptr_assign);
+
+struct bench_node {
+	deferred_ptr<bench_node> next;
+};
+
+void bm_deferred_ptr_assign_in_heap(benchmark::State& state) {
+	deferred_heap heap;
+	auto target = heap.make<bench_node>();
+	vector<deferred_ptr<bench_node>> nodes;
+	for (auto i = 0; i < state.range(0); ++i) {
+		nodes.push_back(heap.make<bench_node>());
+	}
+	for (auto _ : state) {
+		for (auto& n : nodes) {		// register an interior pointer...
+			n->next = target;
+		}
+		for (auto& n : nodes) {		// ... and null it
+			n->next.reset();
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(bm_deferred_ptr_assign_in_heap)->Range(8, 1 << 10);
+
+
+//----------------------------------------------------------------------------
+//
+//	Each deferred_* container alias compared with the same container using
+//	std::allocator, inserting N elements per iteration.
+//
+//	Note: So far only deferred_vector works with libstdc++, whose node-based
+//	containers don't support fancy pointers (see test_deferred_allocator_set).
+//
+//----------------------------------------------------------------------------
+
+template<class C> void add(C& c, int i, decltype(c.push_back(i))* = nullptr) { c.push_back(i); }
+template<class C> void add(C& c, int i, decltype(c.insert(i))* = nullptr) { c.insert(i); }
+template<class C> void add(C& c, int i, typename C::mapped_type* = nullptr) { c.emplace(i, i); }
+
+template<class C>
+void bm_container(benchmark::State& state) {
+	for (auto _ : state) {
+		C c;
+		for (auto i = 0; i < state.range(0); ++i) {
+			add(c, i);
+		}
+		benchmark::DoNotOptimize(c);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template<class C>
+void bm_deferred_container(benchmark::State& state) {
+	deferred_heap heap;
+	for (auto _ : state) {
+		{
+			C c(heap);
+			for (auto i = 0; i < state.range(0); ++i) {
+				add(c, i);
+			}
+			benchmark::DoNotOptimize(c);
+		}
+		state.PauseTiming();
+		heap.collect();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+#define GCPP_BENCHMARK_CONTAINER(std_type, deferred_type)	\
+BENCHMARK_TEMPLATE(bm_container, std_type)->Range(8, 4 << 10);	\
+BENCHMARK_TEMPLATE(bm_deferred_container, deferred_type)->Range(8, 4 << 10)
+
+GCPP_BENCHMARK_CONTAINER(vector<int>, deferred_vector<int>);
+#ifndef __GNUC__
+GCPP_BENCHMARK_CONTAINER(list<int>, deferred_list<int>);
+GCPP_BENCHMARK_CONTAINER(set<int>, deferred_set<int>);
+GCPP_BENCHMARK_CONTAINER(multiset<int>, deferred_multiset<int>);
+GCPP_BENCHMARK_CONTAINER((map<int, int>), (deferred_map<int, int>));
+GCPP_BENCHMARK_CONTAINER((multimap<int, int>), (deferred_multimap<int, int>));
+GCPP_BENCHMARK_CONTAINER(unordered_set<int>, deferred_unordered_set<int>);
+GCPP_BENCHMARK_CONTAINER(unordered_multiset<int>, deferred_unordered_multiset<int>);
+GCPP_BENCHMARK_CONTAINER((unordered_map<int, int>), (deferred_unordered_map<int, int>));
+GCPP_BENCHMARK_CONTAINER((unordered_multimap<int, int>), (deferred_unordered_multimap<int, int>));
+#endif
+
+
+//----------------------------------------------------------------------------
+//
+//	std::pmr containers over gpage_resource and deferred_heap_resource,
+//	compared with the standard monotonic and pool resources, inserting N
+//	elements per iteration into a fresh resource (the deferred_heap is
+//	reused, and collected untimed between iterations).
+//
+//----------------------------------------------------------------------------
+
+template<class C, class Resource>
+void bm_pmr_container(benchmark::State& state) {
+	for (auto _ : state) {
+		Resource r;
+		C c{ &r };
+		for (auto i = 0; i < state.range(0); ++i) {
+			add(c, i);
+		}
+		benchmark::DoNotOptimize(c);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template<class C>
+void bm_pmr_deferred_container(benchmark::State& state) {
+	deferred_heap heap;
+	for (auto _ : state) {
+		{
+			deferred_heap_resource r{ heap };
+			C c{ &r };
+			for (auto i = 0; i < state.range(0); ++i) {
+				add(c, i);
+			}
+			benchmark::DoNotOptimize(c);
+		}
+		state.PauseTiming();
+		heap.collect();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+#define GCPP_BENCHMARK_PMR_CONTAINER(pmr_type)	\
+BENCHMARK_TEMPLATE(bm_pmr_container, pmr_type, pmr::monotonic_buffer_resource)->Range(8, 4 << 10);	\
+BENCHMARK_TEMPLATE(bm_pmr_container, pmr_type, pmr::unsynchronized_pool_resource)->Range(8, 4 << 10);	\
+BENCHMARK_TEMPLATE(bm_pmr_container, pmr_type, gpage_resource)->Range(8, 4 << 10);	\
+BENCHMARK_TEMPLATE(bm_pmr_deferred_container, pmr_type)->Range(8, 4 << 10)
+
+GCPP_BENCHMARK_PMR_CONTAINER(pmr::vector<int>);
+GCPP_BENCHMARK_PMR_CONTAINER(pmr::list<int>);
+GCPP_BENCHMARK_PMR_CONTAINER(pmr::set<int>);
+GCPP_BENCHMARK_PMR_CONTAINER(pmr::unordered_set<int>);
+
+
+//----------------------------------------------------------------------------
+//
+//	std::sort over a deferred_vector, through its own iterators (which are
+//	deferred_ptrs) and through a deferred_span (raw pointers).
+//
+//----------------------------------------------------------------------------
+
+template<class Sort>
+void bm_sort(benchmark::State& state, Sort sort) {
+	deferred_heap heap;
+	deferred_vector<int> v(heap);
+	for (auto _ : state) {
+		state.PauseTiming();
+		v.clear();
+		for (auto i = 0; i < state.range(0); ++i) {
+			v.push_back((i * 7919) % state.range(0));
+		}
+		state.ResumeTiming();
+		sort(v);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void bm_sort_deferred_vector(benchmark::State& state) {
+	bm_sort(state, [](auto& v) { std::sort(v.begin(), v.end()); });
+}
+BENCHMARK(bm_sort_deferred_vector)->Range(64, 16 << 10);
+
+void bm_sort_deferred_span(benchmark::State& state) {
+	bm_sort(state, [](auto& v) {
+		auto span = deferred_span<int>(v);
+		std::sort(span.begin(), span.end());
+	});
+}
+BENCHMARK(bm_sort_deferred_span)->Range(64, 16 << 10);
+
+
+//----------------------------------------------------------------------------
+//
+//	collect() on a synthetic graph, which stays reachable. Arguments:
+//
+//		nodes			total number of nodes
+//		depth			length of each chain of nodes hanging off a root
+//		cycle percent	% of nodes that also point back to the head of their chain
+//
+//----------------------------------------------------------------------------
+
+struct graph_node {
+	deferred_ptr<graph_node> next;
+	deferred_ptr<graph_node> back;
+};
+
+void bm_collect(benchmark::State& state) {
+	const auto nodes = state.range(0), depth = state.range(1), cycles = state.range(2);
+
+	deferred_heap heap;
+	vector<deferred_ptr<graph_node>> roots;
+	for (auto i = 0; i < nodes; i += depth) {
+		roots.push_back(heap.make<graph_node>());
+		auto p = roots.back();
+		for (auto d = 1; d < depth && i + d < nodes; ++d) {
+			p->next = heap.make<graph_node>();
+			p = p->next;
+			if ((i + d) % 100 < cycles) {
+				p->back = roots.back();
+			}
+		}
+	}
+
+	for (auto _ : state) {
+		heap.collect();
+	}
+	state.SetItemsProcessed(state.iterations() * nodes);
+	state.counters["nodes"] = (double)nodes;
+}
+BENCHMARK(bm_collect)
+	->ArgNames({ "nodes", "depth", "cycle%" })
+	->Args({ 1 << 10, 1, 0 })
+	->Args({ 1 << 10, 1 << 10, 0 })
+	->Args({ 1 << 10, 16, 50 })
+	->Args({ 4 << 10, 16, 0 })
+	->Args({ 4 << 10, 16, 100 })
+	->Args({ 4 << 10, 4 << 10, 100 })
+	->Unit(benchmark::kMicrosecond);
+
+//	collect() when most of the heap is garbage: build, drop 'garbage percent'
+//	of the chains, and collect (only the collection is timed)
+//
+void bm_collect_garbage(benchmark::State& state) {
+	const auto nodes = state.range(0), garbage = state.range(1);
+	const auto depth = 16;
+
+	deferred_heap heap;
+	for (auto _ : state) {
+		state.PauseTiming();
+		vector<deferred_ptr<graph_node>> roots;
+		for (auto i = 0; i < nodes; i += depth) {
+			roots.push_back(heap.make<graph_node>());
+			auto p = roots.back();
+			for (auto d = 1; d < depth; ++d) {
+				p->next = heap.make<graph_node>();
+				p = p->next;
+			}
+		}
+		for (auto i = 0u; i < roots.size(); ++i) {
+			if ((long)(i % 100) < garbage) {
+				roots[i].reset();
+			}
+		}
+		state.ResumeTiming();
+
+		heap.collect();
+
+		state.PauseTiming();
+		roots.clear();
+		heap.collect();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations() * nodes);
+}
+BENCHMARK(bm_collect_garbage)
+	->ArgNames({ "nodes", "garbage%" })
+	->Args({ 4 << 10, 10 })
+	->Args({ 4 << 10, 90 })
+	->Unit(benchmark::kMicrosecond);
+
+//----------------------------------------------------------------------------
+//
+//	One thread-safe heap shared by a number of threads. Each thread attaches,
+//	so it allocates from its own page and buffers its registrations, and
+//	compare the items/s across thread counts to see how close these come to
+//	scaling with cores. The heap is made before the threads start (see
+//	Setup), and no collection runs during the loop; the allocation
+//	benchmark has a fixed iteration count so that its garbage stays bounded.
+//
+//----------------------------------------------------------------------------
+
+deferred_heap* contended_heap = nullptr;		// shared by the threads of one run
+deferred_ptr<int>* contended_root = nullptr;
+
+void make_contended_heap(const benchmark::State&) {
+	contended_heap = new deferred_heap;
+	contended_heap->set_thread_safe(true);
+	contended_root = new deferred_ptr<int>(contended_heap->make<int>(42));
+}
+
+void delete_contended_heap(const benchmark::State&) {
+	delete contended_root;
+	delete contended_heap;
+}
+
+void bm_threaded_make(benchmark::State& state) {
+	contended_heap->attach_thread();
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(contended_heap->make<int>(42));
+	}
+	contended_heap->detach_thread();
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bm_threaded_make)->ThreadRange(1, 8)->Iterations(16 << 10)->UseRealTime()
+	->Setup(make_contended_heap)->Teardown(delete_contended_heap);
+
+void bm_threaded_copy(benchmark::State& state) {
+	contended_heap->attach_thread();
+	for (auto _ : state) {
+		auto q = *contended_root;	// register, then deregister
+		benchmark::DoNotOptimize(q);
+	}
+	contended_heap->detach_thread();
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bm_threaded_copy)->ThreadRange(1, 8)->UseRealTime()
+	->Setup(make_contended_heap)->Teardown(delete_contended_heap);
+
+//----------------------------------------------------------------------------
+//
+//	The page allocator's hot path, which tests one bitflags bit per location
+//	it looks at: fill a gpage with N ints, then deallocate them all. Build
+//	with -DGCPP_CONTRACT_LEVEL=0, 1 (the default) and 2 to compare the cost
+//	of each level of contract checks (see util.h).
+//
+//----------------------------------------------------------------------------
+
+void bm_gpage_fill(benchmark::State& state) {
+	gpage page{ gsl::narrow_cast<std::size_t>(state.range(0)) * 3 * sizeof(int), sizeof(int) };
+	vector<byte*> v;
+	v.reserve(state.range(0));
+	for (auto _ : state) {
+		for (auto i = 0; i < state.range(0); ++i) {
+			v.push_back(page.allocate<int>());
+		}
+		for (auto p : v) {
+			page.deallocate(p);
+		}
+		v.clear();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(bm_gpage_fill)->Range(8, 4 << 10);
+
+BENCHMARK_MAIN();
@@ -33,33 +33,35 @@ namespace gcpp {
 	//----------------------------------------------------------------------------
 
 	class bitflags {
+		static constexpr int bits_per_byte = 8;
+
 		const int size;
 		std::vector<byte> bits;
 
 	public:
 		bitflags(int bits, bool value)
 			: size{ bits }
-			, bits(1 + size / sizeof(byte), value ? byte(0xFF) : byte(0x00))
+			, bits(1 + size / bits_per_byte, value ? byte(0xFF) : byte(0x00))
 		{ 
-			Expects(bits > 0 && "#bits must be positive");
+			GCPP_EXPECTS(bits > 0 && "#bits must be positive");
 		}
 
 		//	Get flag value at position
 		//
 		bool get(int at) const {
-			Expects(0 <= at && at < size && "bitflags get() out of range");
-			return (bits[at / sizeof(byte)] & byte(1 << (at % sizeof(byte)))) > byte(0);
+			GCPP_AUDIT(0 <= at && at < size && "bitflags get() out of range");
+			return (bits[at / bits_per_byte] & byte(1 << (at % bits_per_byte))) > byte(0);
 		}
 
 		//	Set flag value at position
 		//
 		void set(int at, bool value) {
-			Expects(0 <= at && at < size && "bitflags set() out of range");
+			GCPP_AUDIT(0 <= at && at < size && "bitflags set() out of range");
 			if (value) {
-				bits[at / sizeof(byte)] |= byte(1 << (at % sizeof(byte)));
+				bits[at / bits_per_byte] |= byte(1 << (at % bits_per_byte));
 			}
 			else {
-				bits[at / sizeof(byte)] &= byte(0xff ^ (1 << (at % sizeof(byte))));
+				bits[at / bits_per_byte] &= byte(0xff ^ (1 << (at % bits_per_byte)));
 			}
 		}
 
@@ -73,14 +75,14 @@ namespace gcpp {
 		//
 		void set(int from, int to, bool value) {
 			// first set the remaining bits in the partial byte this range begins within
-			while (from < to && from % sizeof(byte) != 0) {
+			while (from < to && from % bits_per_byte != 0) {
 				set(from++, value);
 			}
 
 			// then set whole bytes (makes a significant performance difference)
-			while (from < to && to - from >= sizeof(byte)) {
-				bits[from / sizeof(byte)] = value ? byte(0xFF) : byte(0x00);
-				from += sizeof(byte);
+			while (from < to && to - from >= bits_per_byte) {
+				bits[from / bits_per_byte] = value ? byte(0xFF) : byte(0x00);
+				from += bits_per_byte;
 			}
 
 			// then set the remaining bits in the partial byte this range ends within
@@ -0,0 +1,86 @@
+
+/////////////////////////////////////////////////////////////////////////////// 
+// 
+// Copyright (c) 2016 Herb Sutter. All rights reserved. 
+// 
+// This code is licensed under the MIT License (MIT). 
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+// THE SOFTWARE. 
+// 
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef GCPP_COLLECT_TRACE
+#define GCPP_COLLECT_TRACE
+
+#include "deferred_heap.h"
+
+#include <ostream>
+#include <chrono>
+
+namespace gcpp {
+
+	//----------------------------------------------------------------------------
+	//
+	//	chrome_trace_writer - Write collect_events as Chrome trace-event JSON,
+	//	which chrome://tracing and https://ui.perfetto.dev can display. Each
+	//	phase becomes a complete ("X") event, timed in microseconds from the
+	//	writer's construction. For example:
+	//
+	//		std::ofstream file{ "collect.json" };
+	//		chrome_trace_writer trace{ file };
+	//		heap.set_collect_observer(std::ref(trace));
+	//
+	//	The writer must outlive its use by the heap, and the trace is complete
+	//	when the writer is destroyed.
+	//
+	//----------------------------------------------------------------------------
+
+	class chrome_trace_writer {
+		std::ostream&						 out;
+		std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+		bool								 first = true;
+
+		chrome_trace_writer(const chrome_trace_writer&) = delete;
+		void operator=(const chrome_trace_writer&) = delete;
+
+		template<class Duration>
+		static double microseconds(Duration d) {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0;
+		}
+
+	public:
+		chrome_trace_writer(std::ostream& out_)
+			: out{ out_ }
+		{
+			out << "{\"traceEvents\":[";
+		}
+
+		~chrome_trace_writer() {
+			out << "\n]}\n";
+			out.flush();
+		}
+
+		void operator()(const collect_event& e) {
+			out << (first ? "\n" : ",\n");
+			first = false;
+			out << "{\"name\":\"" << e.phase << "\""
+				<< ",\"cat\":\"" << (e.minor ? "gc,minor" : "gc") << "\""
+				<< ",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+				<< ",\"ts\":" << microseconds(e.start - origin)
+				<< ",\"dur\":" << microseconds(e.duration)
+				<< ",\"args\":{\"collection\":" << e.collection
+				<< ",\"objects_visited\":" << e.objects_visited
+				<< ",\"edges_traced\":" << e.edges_traced << "}}";
+		}
+	};
+
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include <map>
 #include <unordered_set>
 #include <unordered_map>
+#include <new>
 
 namespace gcpp {
 
@@ -80,9 +81,16 @@ namespace gcpp {
 		{
 		}
 
-		pointer allocate(size_type n) 
+		//	Not inlined, so that the allocation profiler sees the caller (see
+		//	deferred_heap::make)
+		//
+		GCPP_NOINLINE pointer allocate(size_type n)
 		{
-			return h.allocate<value_type>(n);
+			auto p = h.allocate<value_type>(gsl::narrow_cast<int>(n), GCPP_RETURN_ADDRESS());
+			if (p == nullptr) {
+				throw std::bad_alloc{};	// e.g., the heap's max_heap_bytes is reached
+			}
+			return p;
 		}
 
 		void deallocate(pointer, size_type) noexcept
@@ -150,7 +158,7 @@ namespace gcpp {
 	template<class K, class C = std::less<K>>
 	using deferred_set = std::set<K, C, deferred_allocator<K>>;
 
-	template<class K, class T, class C = std::less<K>>
+	template<class K, class C = std::less<K>>
 	using deferred_multiset = std::multiset<K, C, deferred_allocator<K>>;
 
 	template<class K, class T, class C = std::less<K>>
@@ -169,7 +177,7 @@ namespace gcpp {
 	using deferred_unordered_map = std::unordered_map<K, T, H, E, deferred_allocator<std::pair<const K, T>>>;
 
 	template<class K, class T, class H = std::hash<K>, class E = std::equal_to<K>>
-	using deferred_unordered_multimap = std::unordered_multimap<K, H, E, deferred_allocator<std::pair<const K, T>>>;
+	using deferred_unordered_multimap = std::unordered_multimap<K, T, H, E, deferred_allocator<std::pair<const K, T>>>;
 
 }
 
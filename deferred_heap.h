@@ -25,14 +25,33 @@
 #include <list>
 #include <utility>
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
 #include <algorithm>
 #include <type_traits>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <limits>
+#include <functional>
+#include <chrono>
+#include <typeinfo>
+#include <iterator>
+#include <future>
+#include <thread>
 
 namespace gcpp {
 	template<class T> class deferred_ptr;
-
-	//  destructor contains a pointer and type-correct-but-erased dtor call.
+	template<class T> class deferred_weak_ptr;
+	template<class K, class V> class deferred_ephemeron;
+	template<class T> class deferred_span;
+
+	//  destructor contains a pointer and type-correct-but-erased dtor call,
+	//	for 'count' consecutive objects of 'size' bytes each starting at p, so
+	//	that an array costs one record however long it is. Each heap page
+	//	keeps its own; records never overlap and are kept sorted by address,
+	//	so finding the ones in a range is a binary search.
 	//  (Happily, a noncapturing lambda decays to a function pointer, which
 	//	will make these both easy to construct and cheap to store without
 	//	resorting to the usual type-erasure machinery.)
@@ -40,32 +59,38 @@ namespace gcpp {
 	class destructors {
 		struct destructor {
 			const byte* p;
+			std::size_t count;
+			std::size_t size;
 			void(*destroy)(const void*);
+
+			const byte* end() const noexcept { return p + count * size; }
 		};
 		std::vector<destructor>	dtors;
+		std::size_t				objects = 0;	// sum of the counts
+
+		//	The first record that isn't entirely before p
+		//
+		std::vector<destructor>::iterator first_ending_after(const byte* p) noexcept {
+			return std::partition_point(dtors.begin(), dtors.end(),
+				[=](auto& d) { return d.end() <= p; });
+		}
 
 	public:
 		//	Store the destructor, if it's not trivial
 		//
 		template<class T>
 		void store(gsl::span<T> p) {
-			Expects(p.size() > 0
+			GCPP_EXPECTS(p.size() > 0
 				&& "no object to register for destruction");
 			if (!std::is_trivially_destructible<T>::value) {
-				//	For now we'll just store individual dtors even for arrays.
-				//	Future: To represent destructors for arrays more compactly,
-				//	have an array_destructor type as well with a count and size,
-				//  and when storing a new destructor check if it's immediately
-				//	after the end of an existing array destructor and if so just
-				//	++count, similarly when removing a destructor from the end,
-				//	or break apart an array_destructor when removing a
-				//	destructor from the middle
-				for (auto& t : p) {
-					dtors.push_back({
-						reinterpret_cast<const byte*>(&t),		// address
-						[](const void* x) { reinterpret_cast<const T*>(x)->~T(); }
-					});											// dtor to invoke
-				}
+				auto at = reinterpret_cast<const byte*>(&*p.begin());
+				dtors.insert(first_ending_after(at), {
+					at,													// address
+					gsl::narrow_cast<std::size_t>(p.size()),			// # objects
+					sizeof(T),
+					[](const void* x) { reinterpret_cast<const T*>(x)->~T(); }
+				});													// dtor to invoke
+				objects += gsl::narrow_cast<std::size_t>(p.size());
 			}
 		}
 
@@ -73,63 +98,286 @@ namespace gcpp {
 		//
 		template<class T>
 		bool is_stored(gsl::not_null<T*> p) noexcept {
-			return std::is_trivially_destructible<T>::value
-				|| std::any_of(dtors.begin(), dtors.end(),
-					[=](auto x) { return x.p == (byte*)p.get(); });
+			if (std::is_trivially_destructible<T>::value) {
+				return true;
+			}
+			auto x = (const byte*)p.get();
+			auto d = first_ending_after(x);
+			return d != dtors.end() && d->p <= x && (x - d->p) % d->size == 0;
 		}
 
 		//	Run all the destructors and clear the list
 		//
 		void run_all() {
 			for (auto& d : dtors) {
-				d.destroy(d.p);	// call object's destructor
+				for (auto i = 0u; i < d.count; ++i) {
+					d.destroy(d.p + i*d.size);	// call object's destructor
+				}
 			}
 			dtors.clear();
+			objects = 0;
 		}
 
-		//	Runn all the destructors for objects in [begin,end)
+		//	Run all the destructors for objects in [begin,end), and return
+		//	how many objects were destroyed
 		//
-		bool run(gsl::span<byte> range) {
-			if (range.size() == 0)
-				return false;
+		std::size_t run(gsl::span<byte> range) {
+			if (dtors.empty() || range.size() == 0)
+				return 0;
 
-			bool ret = false;
+			std::size_t ret = 0;
+			auto first = &*range.begin();
+			auto last = &*--range.end();	// to avoid dereferencing a past-the-end iterator
+
+			//	the records that overlap [first,last] are contiguous
+			auto begin = first_ending_after(first);
+			auto end = begin;
+			while (end != dtors.end() && end->p <= last) {
+				++end;
+			}
+			if (begin == end) {
+				return 0;
+			}
 
 			//	for reentrancy safety, we'll take a local copy of destructors to be run
 			//
-			//	first, move any destructors for objects in this range to a local list...
+			//	first, move any destructors for objects in this range to a local list,
+			//	splitting records that are only partly in the range (only the
+			//	first and last can be) ...
 			//
 			std::vector<destructor> to_destroy;
-			for (auto it = dtors.begin(); it != dtors.end(); /*--*/) {
-				//	<= and -- to avoid dereferencing a past-the-end iterator
-				if (&*range.begin() <= it->p && it->p <= &*--range.end()) {
-					to_destroy.push_back(*it);
-					it = dtors.erase(it);
-					ret = true;
+			std::vector<destructor> to_keep;
+			for (auto it = begin; it != end; ++it) {
+				//	the objects whose addresses are in [first,last]
+				auto lo = first <= it->p ? 0 : (first - it->p + it->size - 1) / it->size;
+				auto hi = std::min<std::size_t>(it->count, (last - it->p) / it->size + 1);
+				if (lo > 0) {
+					to_keep.push_back({ it->p, lo, it->size, it->destroy });
 				}
-				else {
-					++it;
+				if (lo < hi) {
+					to_destroy.push_back({ it->p + lo*it->size, hi - lo, it->size, it->destroy });
+					ret += hi - lo;
+				}
+				if (hi < it->count) {
+					to_keep.push_back({ it->p + hi*it->size, it->count - hi, it->size, it->destroy });
 				}
 			}
+			dtors.insert(dtors.erase(begin, end), to_keep.begin(), to_keep.end());
+			objects -= ret;
 
 			//	... then, execute them now that we're done using private state
 			//
 			for (auto& d : to_destroy) {
-				//	=====================================================================
-				//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
-				d.destroy(d.p);	// call object's destructor
-				//  === END REENTRANCY-SAFE: reload any stored copies of private state
-				//	=====================================================================
+				for (auto i = 0u; i < d.count; ++i) {
+					//	=====================================================================
+					//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
+					d.destroy(d.p + i*d.size);	// call object's destructor
+					//  === END REENTRANCY-SAFE: reload any stored copies of private state
+					//	=====================================================================
+				}
 			}
 
 			//	else there wasn't a nontrivial destructor
 			return ret;
 		}
 
+		//	Move the destructors for objects in [begin,end), which are being
+		//	relocated to the same offsets from 'to', into 'dst' (a record is
+		//	always within one allocation, so it moves as a whole), and return
+		//	how many objects moved. If this throws, nothing has changed.
+		//
+		std::size_t move_to(gsl::span<byte> range, byte* to, destructors& dst) {
+			if (range.size() == 0)
+				return 0;
+
+			auto first = &*range.begin();
+			auto last = &*--range.end();
+			auto begin = std::partition_point(dtors.begin(), dtors.end(),
+				[=](auto& d) { return d.p < first; });
+			auto end = begin;
+			while (end != dtors.end() && end->p <= last) {
+				++end;
+			}
+			if (begin == end) {
+				return 0;
+			}
+
+			//	the space at 'to' is unused, so the records go in together
+			auto at = dst.dtors.insert(dst.first_ending_after(to), begin, end);
+			std::size_t ret = 0;
+			for (auto n = end - begin; n > 0; --n, ++at) {
+				at->p = to + (at->p - first);
+				ret += at->count;
+			}
+			dtors.erase(begin, end);
+			objects -= ret;
+			dst.objects += ret;
+			return ret;
+		}
+
+		//	Move every record into the destructors that where(address)
+		//	returns for it. If this throws, the records not yet moved remain.
+		//
+		template<class Where>
+		void move_all(Where where) {
+			while (!dtors.empty()) {
+				auto& d = dtors.back();
+				destructors& dst = where(d.p);
+				dst.dtors.insert(dst.first_ending_after(d.p), d);
+				dst.objects += d.count;
+				objects -= d.count;
+				dtors.pop_back();
+			}
+		}
+
+		//	Call f(begin, end, count) with the extent and number of objects
+		//	of each record
+		//
+		template<class F>
+		void for_each_range(F f) const {
+			for (auto& d : dtors) {
+				f(d.p, d.end(), d.count);
+			}
+		}
+
+		//	The number of objects with pending destructors
+		//
+		std::size_t size() const noexcept {
+			return objects;
+		}
+
 		void debug_print() const;
 	};
 
 
+	//----------------------------------------------------------------------------
+	//
+	//	collect_policy: When allocation collects automatically. Every trigger
+	//	is off by default, so a heap only collects when asked to.
+	//
+	//	allocation_threshold	Collect once this many bytes have been allocated
+	//							since the last collection (0 = never)
+	//	collect_before_expand	Collect before adding any page
+	//	growth_factor			Collect before adding a page that would make the
+	//							heap bigger than growth_factor times the bytes the
+	//							last collection found live (0 = never)
+	//	max_heap_bytes			Hard cap on the total size of all pages; if a
+	//							collection doesn't make room, allocation fails and
+	//							returns null (0 = no limit)
+	//	trigger					Custom trigger consulted before adding a page;
+	//							return true to collect first
+	//
+	//----------------------------------------------------------------------------
+
+	struct collect_trigger_info {
+		std::size_t bytes_allocated;	// since the last collection
+		std::size_t live_bytes;			// found live by the last collection
+		std::size_t heap_bytes;			// total size of all pages
+		std::size_t page_bytes;			// size of the page we want to add
+	};
+
+	struct collect_policy {
+		std::size_t	allocation_threshold = 0;
+		bool		collect_before_expand = false;
+		double		growth_factor = 0;
+		std::size_t	max_heap_bytes = 0;
+		std::function<bool(const collect_trigger_info&)> trigger;
+	};
+
+
+	//----------------------------------------------------------------------------
+	//
+	//	heap_stats: A snapshot of a deferred_heap's counters (see stats())
+	//
+	//	collect_pause is the time one collection (or the sum of several)
+	//	spent in each phase: resetting the marks, marking, nulling unreached
+	//	deferred_ptrs, and sweeping (running destructors and deallocating).
+	//	The marking time of an incremental collection is that of all its steps.
+	//
+	//----------------------------------------------------------------------------
+
+	struct collect_pause {
+		std::chrono::nanoseconds reset{ 0 };
+		std::chrono::nanoseconds mark{ 0 };
+		std::chrono::nanoseconds null{ 0 };
+		std::chrono::nanoseconds sweep{ 0 };
+
+		std::chrono::nanoseconds total() const noexcept { return reset + mark + null + sweep; }
+
+		collect_pause& operator+=(const collect_pause& that) noexcept {
+			reset += that.reset;
+			mark  += that.mark;
+			null  += that.null;
+			sweep += that.sweep;
+			return *this;
+		}
+	};
+
+	struct heap_stats {
+		std::size_t	pages = 0;
+		std::size_t	bytes_reserved = 0;			// total size of all pages
+		std::size_t	bytes_used = 0;				// allocated, in whole locations
+		std::size_t	bytes_fragmented = 0;		// free, but on pages that are in use
+		std::size_t	live_allocations = 0;
+		std::size_t	roots = 0;					// deferred_ptrs outside the heap
+		std::size_t	interior_pointers = 0;		// deferred_ptrs inside the heap
+		std::size_t	weak_pointers = 0;			// deferred_weak_ptrs anywhere
+		std::size_t	pending_destructors = 0;
+
+		std::size_t	total_allocations = 0;		// since the heap was created
+		std::size_t	total_bytes_allocated = 0;
+		std::size_t	collections = 0;			// full and minor
+		std::size_t	minor_collections = 0;
+		std::size_t	bytes_freed = 0;
+		collect_pause last_pause;
+		collect_pause total_pause;
+	};
+
+	//----------------------------------------------------------------------------
+	//
+	//	collect_event: One phase of one collection, as reported to the collect
+	//	observer (see set_collect_observer). An incremental collection reports
+	//	each of its marking steps separately.
+	//
+	//	objects_visited		reset: deferred_ptrs reset; mark: allocations
+	//						newly marked; null: deferred_ptrs nulled;
+	//						sweep: allocations deallocated
+	//	edges_traced		mark: deferred_ptrs followed (roots included)
+	//
+	//----------------------------------------------------------------------------
+
+	struct collect_event {
+		const char*		phase;			// "reset", "mark", "null" or "sweep"
+		std::size_t		collection;		// 1 for the heap's first collection, etc.
+		bool			minor;
+		std::chrono::steady_clock::time_point start;
+		std::chrono::nanoseconds duration;
+		std::size_t		objects_visited;
+		std::size_t		edges_traced;
+	};
+
+	//----------------------------------------------------------------------------
+	//
+	//	allocation_site: What the allocation profiler found still live at the
+	//	end of the last collection that was allocated by one piece of code
+	//	(see set_allocation_sampling)
+	//
+	//	site is the return address of the call to make, make_array,
+	//	allocate_bytes or deferred_allocator::allocate that allocated, so each
+	//	call site gets its own entry (for a container, the site is in the
+	//	container's code); use a symbolizer such as addr2line or dladdr to
+	//	turn it into a source location
+	//
+	//----------------------------------------------------------------------------
+
+	struct allocation_site {
+		const char*	type;		// typeid(T).name() of what was allocated
+		const void*	site;
+		std::size_t	samples;	// sampled allocations still live
+		std::size_t	bytes;		// estimated bytes still live
+	};
+
+
 	//----------------------------------------------------------------------------
 	//
 	//	The deferred heap produces deferred_ptr<T>s via make<T>.
@@ -139,8 +387,14 @@ namespace gcpp {
 	class deferred_heap {
 		class  deferred_ptr_void;
 		friend class deferred_ptr_void;
+		class  deferred_weak_ptr_void;
+		friend class deferred_weak_ptr_void;
+		class  ephemeron_void;
+		friend class ephemeron_void;
 
 		template<class T> friend class deferred_ptr;
+		template<class T> friend class deferred_weak_ptr;
+		template<class K, class V> friend class deferred_ephemeron;
 		template<class T> friend class deferred_allocator;
 
 		//	Disable copy and move
@@ -151,6 +405,33 @@ namespace gcpp {
 		//	Invoked when constructing and destroying a deferred_ptr.
 		void enregister(const deferred_ptr_void& p);
 		void deregister(const deferred_ptr_void& p);
+		void add_registration(const deferred_ptr_void& p, const void* value);
+		void remove_registration(const deferred_ptr_void& p, const void* value);
+		void enregister_weak(const deferred_weak_ptr_void& p);
+		void deregister_weak(const deferred_weak_ptr_void& p);
+		void enregister_ephemeron(ephemeron_void& e);
+		void deregister_ephemeron(ephemeron_void& e);
+
+		//	Return a deferred_ptr to what a deferred_weak_ptr points to
+		//	(see deferred_weak_ptr::lock)
+		//
+		template<class T>
+		deferred_ptr<T> lock_weak(T* p);
+
+		//	Return whether the collection in progress has found the allocation
+		//	that p points into to be reachable (or isn't collecting its page)
+		//
+		bool is_reached(const void* p) const noexcept;
+
+		//	Return the extent of the allocation p points into, for checking
+		//	deferred_ptr arithmetic (the end includes the extra location that
+		//	gpage reserves, so one-past-the-end of an array is inside it)
+		//
+		struct allocation_bounds {
+			const byte* begin;
+			const byte* end;
+		};
+		allocation_bounds find_allocation(const void* p) const noexcept;
 
 		//------------------------------------------------------------------------
 		//
@@ -190,17 +471,72 @@ namespace gcpp {
 			deferred_heap* myheap;
 			void* p;
 
+#ifndef NDEBUG
+			//	The allocation p points into, cached the first time checked
+			//	pointer arithmetic needs it so that iterating is O(1) per step.
+			//	Arithmetic keeps p in the same allocation, so the cache stays
+			//	valid until p is repointed (or the allocation is moved).
+			//
+			mutable const byte* bounds_begin = nullptr;
+			mutable const byte* bounds_end = nullptr;
+#endif
+
 			friend deferred_heap;
 
+			void forget_bounds() const noexcept {
+#ifndef NDEBUG
+				bounds_begin = bounds_end = nullptr;
+#endif
+			}
+
+			void copy_bounds(const deferred_ptr_void& that) noexcept {
+#ifndef NDEBUG
+				bounds_begin = that.bounds_begin;
+				bounds_end = that.bounds_end;
+#else
+				(void)that;
+#endif
+			}
+
+			//	See deferred_heap::shade
+			//
+			void write_barrier() noexcept {
+				if (p != nullptr && myheap != nullptr
+					&& myheap->phase == collect_phase::marking) {
+					myheap->shade(p);
+				}
+			}
+
 		protected:
-			void  set(void* p_) noexcept { p = p_; }
+			//	Repoint within the same allocation (see bounds). While that
+			//	holds, p keeps the old pointee reachable, so the write barrier
+			//	only has work to do if p_ has left the allocation (e.g., one
+			//	past the end of a single object can be the next allocation).
+			void  set(void* p_) noexcept {
+				if (p != nullptr && myheap != nullptr
+					&& myheap->phase == collect_phase::marking) {
+					myheap->shade_unless_within(p, p_);
+				}
+				p = p_;
+			}
+
+#ifndef NDEBUG
+			allocation_bounds bounds() const noexcept {
+				if (!(bounds_begin <= (const byte*)p && (const byte*)p < bounds_end)) {
+					auto b = myheap->find_allocation(p);
+					bounds_begin = b.begin;
+					bounds_end = b.end;
+				}
+				return{ bounds_begin, bounds_end };
+			}
+#endif
 
 			deferred_ptr_void(deferred_heap* heap = nullptr, void* p_ = nullptr)
 				: myheap{ heap }
 				, p{ p_ }
 			{
 				//	Allow null pointers, we'll set the page on the first assignment
-				Expects((p == nullptr || myheap != nullptr) && "heap cannot be null for a non-null pointer");
+				GCPP_EXPECTS((p == nullptr || myheap != nullptr) && "heap cannot be null for a non-null pointer");
 				if (myheap != nullptr) {
 					myheap->enregister(*this);
 				}
@@ -214,35 +550,63 @@ namespace gcpp {
 
 			deferred_ptr_void(const deferred_ptr_void& that)
 				: deferred_ptr_void(that.myheap, that.p)
-			{ }
+			{
+				copy_bounds(that);
+			}
+
+			//	Moving registers the new pointer like a copy, and nulls the old
+			//	one. It's noexcept (registering fails only if memory runs out,
+			//	as in copy assignment) so that objects holding deferred_ptrs
+			//	can be moved by compaction.
+			//
+			deferred_ptr_void(deferred_ptr_void&& that) noexcept
+				: deferred_ptr_void(that.myheap, that.p)
+			{
+				copy_bounds(that);
+				that.reset();
+			}
 
 			deferred_ptr_void& operator=(const deferred_ptr_void& that) noexcept {
 				//	Allow assignment from an unattached null pointer
 				if (that.myheap == nullptr) {
-					Expects(that.p == nullptr && "unattached deferred_ptr must be null");
+					GCPP_EXPECTS(that.p == nullptr && "unattached deferred_ptr must be null");
 					reset();	// just to keep the nulling logic in one place
 				}
 
 				//	Otherwise, we must be unattached or pointing into the same heap
 				else {
-					Expects((myheap == nullptr || myheap == that.myheap)
+					GCPP_EXPECTS((myheap == nullptr || myheap == that.myheap)
 						&& "cannot assign deferred_ptrs into different deferred_heaps");
+					write_barrier();
 					p = that.p;
+					copy_bounds(that);
 					if (myheap == nullptr) {
 						that.myheap->enregister(*this);	// perform lazy attach
 						myheap = that.myheap;
 					}
+					else if (myheap->generational) {
+						myheap->remember(*this);	// see deferred_heap::collect_minor
+					}
 				}
 
 				return *this;
 			}
 
+			deferred_ptr_void& operator=(deferred_ptr_void&& that) noexcept {
+				if (this != &that) {
+					*this = that;
+					that.reset();
+				}
+				return *this;
+			}
+
 			//	detach is called from ~deferred_heap() when the heap is destroyed
 			//	before this pointer is destroyed
 			//
 			void detach() noexcept {
 				p = nullptr;
 				myheap = nullptr;
+				forget_bounds();
 			}
 
 		public:
@@ -250,26 +614,184 @@ namespace gcpp {
 
 			void* get() const noexcept { return p; }
 
-			void  reset() noexcept { p = nullptr; /* leave myheap alone so we can assign again */ }
+			void  reset() noexcept { write_barrier(); p = nullptr; forget_bounds(); /* leave myheap alone so we can assign again */ }
+		};
+
+		//------------------------------------------------------------------------
+		//
+		//	deferred_weak_ptr_void is the untyped part of deferred_weak_ptr<T>.
+		//	Weak pointers are tracked apart from deferred_ptrs, wherever they
+		//	live: marking never looks at them, and a collection nulls each one
+		//	whose target it is about to destroy. Attachment to a heap works as
+		//	for deferred_ptr_void.
+		//
+		class deferred_weak_ptr_void {
+			deferred_heap* myheap;
+			void* p;
+
+			friend deferred_heap;
+
+			//	detach is called from ~deferred_heap() when the heap is destroyed
+			//	before this pointer is destroyed
+			//
+			void detach() noexcept {
+				p = nullptr;
+				myheap = nullptr;
+			}
+
+		protected:
+			deferred_weak_ptr_void(deferred_heap* heap = nullptr, void* p_ = nullptr)
+				: myheap{ heap }
+				, p{ p_ }
+			{
+				GCPP_EXPECTS((p == nullptr || myheap != nullptr) && "heap cannot be null for a non-null pointer");
+				if (myheap != nullptr) {
+					myheap->enregister_weak(*this);
+				}
+			}
+
+			~deferred_weak_ptr_void() {
+				if (myheap != nullptr) {
+					myheap->deregister_weak(*this);
+				}
+			}
+
+			deferred_weak_ptr_void(const deferred_weak_ptr_void& that)
+				: deferred_weak_ptr_void(that.myheap, that.p)
+			{ }
+
+			deferred_weak_ptr_void& operator=(const deferred_weak_ptr_void& that) noexcept {
+				assign(that.myheap, that.p);
+				return *this;
+			}
+
+			//	Point at p in heap (from a weak or a strong pointer)
+			//
+			void assign(deferred_heap* heap, void* p_) noexcept {
+				//	Allow assignment from an unattached null pointer
+				if (heap == nullptr) {
+					GCPP_EXPECTS(p_ == nullptr && "unattached pointer must be null");
+					reset();
+					return;
+				}
+
+				//	Otherwise, we must be unattached or pointing into the same heap
+				GCPP_EXPECTS((myheap == nullptr || myheap == heap)
+					&& "cannot assign deferred_weak_ptrs into different deferred_heaps");
+				if (myheap == nullptr) {
+					heap->enregister_weak(*this);	// perform lazy attach
+					myheap = heap;
+				}
+				p = p_;
+			}
+
+			void* get() const noexcept { return p; }
+
+		public:
+			deferred_heap* get_heap() const noexcept { return myheap; }
+
+			//	Whether the object has been collected (or this was never set)
+			//
+			bool expired() const noexcept { return p == nullptr; }
+
+			void reset() noexcept { p = nullptr; }
+		};
+
+		//------------------------------------------------------------------------
+		//
+		//	ephemeron_void is the untyped part of deferred_ephemeron<K,V>: a
+		//	key/value pair whose value is kept alive only while the key is
+		//	reachable from elsewhere. Neither pointer is traced as such. Once
+		//	marking has reached the key, the value is traced too (which may
+		//	reach other ephemerons' keys), and if the key is never reached both
+		//	are nulled before the sweep. An ephemeron that is itself stored in
+		//	the heap counts only once marking has reached the object holding
+		//	it; if that is never reached, it is nulled along with that object.
+		//
+		class ephemeron_void {
+			deferred_heap* myheap;
+			void* key = nullptr;
+			void* value = nullptr;
+			bool traced = false;	// whether marking has traced value
+
+			friend deferred_heap;
+
+			ephemeron_void(const ephemeron_void&) = delete;
+			void operator=(const ephemeron_void&) = delete;
+
+			//	detach is called from ~deferred_heap() when the heap is destroyed
+			//	before this ephemeron is destroyed
+			//
+			void detach() noexcept {
+				key = value = nullptr;
+				myheap = nullptr;
+			}
+
+		protected:
+			ephemeron_void(deferred_heap& heap)
+				: myheap{ &heap }
+			{
+				myheap->enregister_ephemeron(*this);
+			}
+
+			~ephemeron_void() {
+				if (myheap != nullptr) {
+					myheap->deregister_ephemeron(*this);
+				}
+			}
+
+			void set(void* key_, void* value_) {
+				GCPP_EXPECTS(myheap != nullptr && "the heap has been destroyed");
+				GCPP_EXPECTS((key_ != nullptr || value_ == nullptr) && "an ephemeron's value needs a key");
+				auto l = myheap->lock();
+
+				//	like deferred_ptr's write barrier, but for both values: the
+				//	old one may have been copied somewhere marking has passed,
+				//	and the new one is reachable only through this ephemeron
+				if (myheap->phase == collect_phase::marking) {
+					myheap->shade(value);
+					myheap->shade(value_);
+				}
+				key = key_;
+				value = value_;
+			}
+
+			void* get_key() const noexcept { return key; }
+			void* get_value() const noexcept { return value; }
+
+		public:
+			deferred_heap& get_heap() const noexcept { return *myheap; }
+
+			//	Whether the key has been collected (or was never set)
+			//
+			bool expired() const noexcept { return key == nullptr; }
 		};
 
-		//	For non-roots (deferred_ptrs that are in the deferred heap), we'll additionally
-		//	store an int that we'll use for terminating marking within the deferred heap.
-		//  The level is the distance from some root -- not necessarily the smallest
-		//	distance from a root, just along whatever path we took during marking.
+		//	For non-roots (deferred_ptrs that are in the deferred heap), each page
+		//	keeps a list. Marking sorts it by address, so that the ones inside an
+		//	allocation can be found by binary search when the allocation is traced.
 		//
 		struct nonroot {
 			const deferred_ptr_void* p;
-			std::size_t level = 0;
 
 			nonroot(const deferred_ptr_void* p_) noexcept : p{ p_ } { }
 		};
 
+		struct thread_buffer;
+
 		struct dhpage {
 			gpage				 page;
 			bitflags		 	 live_starts;	// for tracing
 			std::vector<nonroot> deferred_ptrs;	// known deferred_ptrs in this page
+			std::size_t			 sorted_ptrs = 0;	// while marking, [0,sorted_ptrs) are by address
 			deferred_heap*		 myheap;
+			std::size_t			 empty_collections = 0;	// # consecutive collections found empty
+			bitflags			 old_starts;			// promoted allocations (generational mode)
+			std::size_t			 young_allocations = 0;	// # not promoted (generational mode)
+			destructors			 dtors;					// for the objects in this page
+			bool				 evacuating = false;	// being emptied by compact()
+			int					 node;					// NUMA node the page was created for
+			thread_buffer*		 owner = nullptr;		// the thread allocating from it, if any
 
 			//	Construct a page tuned to hold Hint objects, big enough for
 			//	at least 1 + phi ~= 2.62 of these requests (but at least 8K),
@@ -278,12 +800,28 @@ namespace gcpp {
 			//	Future: Don't allocate objects on pages with chunk sizes > 2 * object size
 			//
 			template<class Hint>
-			dhpage(const Hint* /*--*/, size_t n, deferred_heap* heap)
-				: page{ std::max<size_t>(sizeof(Hint) * n * 3, 8192 /*good general default*/), 
-						std::max<size_t>(sizeof(Hint), 4) }
+			static std::size_t size_for(size_t n) noexcept {
+				return std::max<size_t>(sizeof(Hint) * n * 3, 8192 /*good general default*/);
+			}
+
+			template<class Hint>
+			dhpage(const Hint* /*--*/, size_t n, deferred_heap* heap, int node_)
+				: page{ size_for<Hint>(n), 
+						std::max<size_t>(sizeof(Hint), 4),
+						heap->page_storage,
+						heap->numa_aware ? node_ : -1 }
 				, live_starts{ page.locations(), false }
 				, myheap{ heap }
+				, old_starts{ page.locations(), false }
+				, node{ node_ }
 			{ }
+
+			//	Whether p is in an allocation that a minor collection promoted
+			//
+			bool in_old_allocation(const void* p) const noexcept {
+				return old_starts.get(gsl::narrow_cast<int>(
+					page.contains_info((const byte*)p).start_location));
+			}
 		};
 
 
@@ -291,108 +829,715 @@ namespace gcpp {
 		//	Data: Storage and tracking information
 		//
 		std::list<dhpage>							 pages;
+		std::vector<std::vector<dhpage*>>			 pages_by_node;	// index into pages
+		std::map<const byte*, dhpage*>				 pages_by_address;	// by page start
 		std::unordered_set<const deferred_ptr_void*> roots;	// outside deferred heap
-		destructors									 dtors;
+		std::unordered_set<const deferred_weak_ptr_void*> weak_ptrs;	// anywhere, not traced
+		std::unordered_set<ephemeron_void*>			 ephemerons;	// traced only via keys
 
 		bool is_destroying = false;
-		bool collect_before_expand = false;	// Future: pull this into an options struct
-
+		bool is_resetting = false;
+		std::size_t address_epoch = 0;			// see epoch()
+		std::size_t empty_page_retention = 0;	// # collections an empty page survives
 
-	public:
 		//------------------------------------------------------------------------
+		//	Data: Automatic collection (see set_collect_policy)
 		//
-		//	Construct and destroy
+		collect_policy policy;
+		std::size_t bytes_since_collect = 0;		// allocated since the last collection
+		std::size_t live_bytes_after_collect = 0;	// in use after the last collection
+		std::size_t heap_bytes = 0;					// total size of all pages
+
+		//------------------------------------------------------------------------
+		//	Data: Page placement (see set_page_storage and set_numa_aware)
 		//
-		deferred_heap() = default;
+		gpage_storage page_storage = gpage_storage::heap;	// for newly created pages
+		bool numa_aware = false;							// see set_numa_aware
 
-		~deferred_heap();
+		//	Return the pages, those on the calling thread's NUMA node first
+		//
+		std::vector<dhpage*> pages_local_first();
 
 		//------------------------------------------------------------------------
+		//	Data: Statistics (see stats())
 		//
-		//	make: Allocate one object of type T initialized with args
+		//	The current totals are kept up to date as pages change, so that
+		//	stats() never has to visit the pages; verify() checks them.
 		//
-		//	If allocation fails, the returned pointer will be null
+		using clock = std::chrono::steady_clock;
+
+		static std::chrono::nanoseconds since(clock::time_point start) {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start);
+		}
+
+		std::size_t		total_allocations = 0;
+		std::size_t		total_bytes_allocated = 0;
+		std::size_t		collections = 0;
+		std::size_t		minor_collections = 0;
+		std::size_t		bytes_freed = 0;
+		collect_pause	this_pause;		// of the collection in progress
+		collect_pause	last_pause;
+		collect_pause	total_pause;
+		std::size_t		objects_marked = 0;	// in the phase in progress
+
+		std::size_t		bytes_used = 0;				// allocated, in whole locations
+		std::size_t		bytes_in_nonempty_pages = 0;	// total size of pages in use
+		std::size_t		live_allocations = 0;
+		std::size_t		interior_pointers = 0;		// sum of the pages' deferred_ptrs
+		std::size_t		pending_destructors = 0;	// sum of the pages' dtors.size()
+
+		//	Update the totals above (or a thread's share of them, see
+		//	thread_buffer) for a change to pg's allocations, given its usage
+		//	before the change
 		//
-		template<class T, class ...Args>
-		deferred_ptr<T> make(Args&&... args) {
-			auto p = allocate<T>();
-			if (p != nullptr) {
-				construct<T>(p.get(), std::forward<Args>(args)...);
-			}
-			return p;
+		struct page_usage {
+			std::size_t bytes;
+			std::size_t allocations;
+		};
+		static page_usage usage_of(const dhpage& pg) noexcept {
+			return{ pg.page.bytes_in_use(), pg.page.allocations() };
+		}
+		static void count_change(const dhpage& pg, page_usage before, std::size_t& used,
+			std::size_t& in_nonempty_pages, std::size_t& allocations) noexcept;
+		void count_change(const dhpage& pg, page_usage before) noexcept {
+			count_change(pg, before, bytes_used, bytes_in_nonempty_pages, live_allocations);
 		}
 
+		std::function<void(const collect_event&)> observer;
+
+		void end_phase(const char* name, std::chrono::nanoseconds collect_pause::* time,
+			clock::time_point start, std::size_t visited, std::size_t edges);
+
 		//------------------------------------------------------------------------
+		//	Data: Generational collection (opt-in, see set_generational)
 		//
-		//	make_array: Allocate n default-constructed objects of type T
+		//	Each allocation is young (in the nursery) until it survives a minor
+		//	collection, which promotes it; a page can hold both, and new objects
+		//	go wherever there is room, so promoted objects don't strand the free
+		//	space around them. A minor collection traces just the nursery,
+		//	starting from the roots and from the remembered set, which holds the
+		//	deferred_ptrs in promoted allocations that may have been pointed into
+		//	the nursery since the last minor collection. Pages without young
+		//	allocations are skipped in O(1).
 		//
-		//	If allocation fails, the returned pointer will be null
-		//
-		template<class T>
-		deferred_ptr<T> make_array(std::size_t n) {
-			auto p = allocate<T>(n);
-			if (p != nullptr) {
-				construct_array<T>(p.get(), n);
-			}
-			return p;
-		}
+		bool generational = false;
+		bool minor_in_progress = false;
+		std::size_t nursery_page_limit = 0;	// 0 = no automatic minor collections
+		std::unordered_set<const deferred_ptr_void*> remembered;
+
+		void remember(const deferred_ptr_void& p);
+		bool points_old_to_young(const deferred_ptr_void& p, const dhpage& from) const noexcept;
+		void rebuild_remembered();
 
-	private:
 		//------------------------------------------------------------------------
+		//	Data: Compaction (opt-in, see set_compaction)
 		//
-		//	Core allocator functions: allocate, construct, destroy
-		//	(not deallocate, which is done at collection time)
+		//	We know the address of every deferred_ptr, so we can move objects as
+		//	long as we know how to move them. That's recorded for each allocation
+		//	made by make or make_array of a type whose move constructor doesn't
+		//	throw, so that a compaction can't be left half done; allocations
+		//	made by deferred_allocator, and other types, stay where they are.
 		//
-		//	There are private, for use via deferred_allocator only
+		struct relocator {
+			int count;											// # objects
+			byte* (*allocate_in)(gpage& page, int n);			// a T[n] in page
+			void (*relocate)(void* from, void* to, int n);	// move T[n] from->to
+		};
+
+		bool compaction_enabled = false;
+		std::unordered_map<const byte*, relocator> relocators;	// by allocation start
+
+		template<class T>
+		void store_relocator(T* p, int n, std::true_type /*nothrow movable*/);
 
-		//  Helper: Return the dhpage on which this object exists.
-		//	If the object is not in our storage, returns null.
-		//
 		template<class T>
-		dhpage* find_dhpage_of(T* p) noexcept;
+		void store_relocator(T*, int, std::false_type) { }
+
+		void evacuate(double max_occupancy);
 
-		struct find_dhpage_info_ret {
-			dhpage* page = nullptr;
-			gpage::contains_info_ret info;
+		//------------------------------------------------------------------------
+		//	Data: Allocation-site profiling (opt-in, see set_allocation_sampling)
+		//
+		//	About one allocation per sample_interval bytes is recorded, keyed by
+		//	its start like the relocators, until the collection that frees it.
+		//	Each sample stands for sample_interval bytes (or its own size, if
+		//	that's bigger).
+		//
+		struct allocation_sample {
+			const char*	type;
+			const void*	site;
+			std::size_t	bytes;
 		};
-		template<class T> 
-		find_dhpage_info_ret find_dhpage_info(T* p) noexcept;
+
+		std::size_t sample_interval = 0;	// 0 = no profiling
+		std::size_t bytes_until_sample = 0;
+		std::unordered_map<const byte*, allocation_sample> samples;	// by allocation start
+		std::vector<allocation_site> profile;	// as of the last collection
+
+		//	Record a sampled allocation, and the code it was allocated by. The
+		//	public entry points (make, etc.) are never inlined, and pass their
+		//	own return address down to allocate as the site.
+		//
+		void sample(const byte* p, const char* type, std::size_t bytes, const void* site) {
+			samples[p] = { type, site, std::max(bytes, sample_interval) };
+		}
+		void update_profile();
+
+		//------------------------------------------------------------------------
+		//	Data: Thread safety (opt-in, see set_thread_safe)
+		//
+		//	heap_mutex guards pages (with their destructors) and roots. It is
+		//	recursive because destructors run during collection deregister
+		//	their deferred_ptrs, and constructors and destructors may allocate.
+		//
+		//	Collection additionally stops the world: every thread attached with
+		//	attach_thread() must reach a safepoint() (or detach) before collect()
+		//	looks at any deferred_ptr's value.
+		//
+		using heap_lock = std::unique_lock<std::recursive_mutex>;
+
+		bool						 thread_safe = false;
+		mutable std::recursive_mutex heap_mutex;
+		std::mutex					 safepoint_mutex;
+		std::condition_variable		 safepoint_cv;
+		std::atomic<bool>			 stop_requested{ false };
+		std::atomic<bool>			 world_stopped{ false };	// and the buffers merged
+		std::size_t					 attached_threads = 0;
+		std::size_t					 parked_threads = 0;
+
+		heap_lock lock() const {
+			return thread_safe ? heap_lock{ heap_mutex } : heap_lock{};
+		}
+
+		//	Each attached thread has a thread_buffer, so that the common
+		//	operations don't take heap_mutex:
+		//
+		//	- it allocates from a page that it owns (the page's bits are
+		//	  touched by no other thread meanwhile), and counts the change in
+		//	  the buffer instead of in the running totals;
+		//	- it stores the destructors of the objects it makes in the buffer;
+		//	- it records deferred_ptr registrations and deregistrations, and
+		//	  what the write barrier shades, in the buffer. A deferred_ptr that
+		//	  is destroyed right after it was created (a temporary) cancels out
+		//	  there and never reaches the heap.
+		//
+		//	The thread holds only its buffer's mutex, which nobody else wants
+		//	until the buffer is merged into the heap: when it fills, when the
+		//	thread runs out of page or detaches, in stats(), and for every
+		//	thread when the world is stopped, which also takes their pages
+		//	away (so collection sees one consistent heap, as before). Merging
+		//	holds heap_mutex and then the buffer's mutex.
+		//
+		//	Buffers are merged one at a time, so a deferred_ptr created on one
+		//	thread and destroyed on another may be deregistered before it is
+		//	registered; such a stray deregistration waits for its registration
+		//	(every buffer is merged before a collection looks).
+		//
+		//	A generational heap doesn't use buffers, because its remembered
+		//	set must be kept as deferred_ptrs are created.
+		//
+		struct registration {
+			const deferred_ptr_void* p;
+			const void* value;	// what it pointed to, to shade while marking
+			bool add;
+		};
+
+		struct thread_buffer {
+			std::mutex				  mutex;
+			dhpage*					  page = nullptr;	// see dhpage::owner
+			std::vector<registration> registrations;
+			std::vector<const void*>  shades;
+			destructors				  dtors;			// for objects not yet in their page's
+			std::size_t				  allocations = 0;
+			std::size_t				  bytes_allocated = 0;
+			std::size_t				  bytes_used = 0;	// changes to the running totals
+			std::size_t				  bytes_in_nonempty_pages = 0;
+			std::size_t				  live_allocations = 0;
+		};
+
+		static constexpr std::size_t buffer_records = 256;		// merge when this many
+		static constexpr std::size_t buffer_bytes = 64 * 1024;	// ... or this much allocated
+
+		std::list<thread_buffer>	 thread_buffers;	// guarded by heap_mutex
+		std::vector<const void*>	 pending_shades;	// merged while the world runs
+		std::unordered_map<const deferred_ptr_void*, std::size_t> stray_removals;
+
+		static std::vector<std::pair<const deferred_heap*, thread_buffer*>>& attached_heaps() {
+			thread_local std::vector<std::pair<const deferred_heap*, thread_buffer*>> heaps;	// per thread
+			return heaps;
+		}
+		bool is_attached_thread() const;
+		thread_buffer* local_buffer() const noexcept;
+		void flush(thread_buffer& b);
+		void merge(thread_buffer& b);
+		void merge_thread_buffers();
+		void shade_now_or_later(const void* p) noexcept;
+		void park(std::unique_lock<std::mutex>& l);
+		bool stop_the_world();
+		void resume_the_world();
+
+		//	The background collector (see set_background_collection); its
+		//	flags are guarded by safepoint_mutex
+		//
+		std::thread					 background_thread;
+		std::condition_variable		 background_cv;
+		std::size_t					 background_budget = 0;
+		bool						 background_requested = false;
+		bool						 background_stopping = false;
+		bool						 background_finished = false;
+
+		void run_background_collector();
+		void stop_background_collector();
+
+
+	public:
+		//------------------------------------------------------------------------
+		//
+		//	Construct and destroy
+		//
+		deferred_heap() = default;
+
+		~deferred_heap();
+
+		//------------------------------------------------------------------------
+		//
+		//	make: Allocate one object of type T initialized with args
+		//
+		//	If allocation fails, the returned pointer will be null
+		//
+		//	(The public allocation functions are not inlined, so that their
+		//	return address identifies the caller for the allocation profiler.)
+		//
+		template<class T, class ...Args>
+		GCPP_NOINLINE deferred_ptr<T> make(Args&&... args) {
+			auto p = allocate<T>(1, GCPP_RETURN_ADDRESS());
+			if (p != nullptr) {
+				construct_array<T>(p.get(), 1, [&](T* at) { ::new (at) T{ std::forward<Args>(args)... }; });
+				if (compaction_enabled) {
+					store_relocator(p.get(), 1, typename std::is_nothrow_move_constructible<T>::type{});
+				}
+			}
+			return p;
+		}
+
+		//------------------------------------------------------------------------
+		//
+		//	make_array: Allocate n objects of type T, each initialized with args
+		//	(so by default, default-constructed)
+		//
+		//	make_array_uninitialized: Allocate n objects of a trivial type T,
+		//	leaving them uninitialized
+		//
+		//	make_array_from: Allocate copies of the objects in a range, which
+		//	must have forward iterators because it is traversed twice (once to
+		//	count); an empty range gives a null pointer
+		//
+		//	Each costs one allocation and at most one destructor record,
+		//	however many objects there are. If allocation fails, the returned
+		//	pointer will be null
+		//
+		template<class T, class ...Args>
+		GCPP_NOINLINE deferred_ptr<T> make_array(std::size_t n, const Args&... args) {
+			auto p = allocate<T>(n, GCPP_RETURN_ADDRESS());
+			if (p != nullptr) {
+				construct_array<T>(p.get(), n, [&](T* at) { ::new (at) T{ args... }; });
+				if (compaction_enabled) {
+					store_relocator(p.get(), n, typename std::is_nothrow_move_constructible<T>::type{});
+				}
+			}
+			return p;
+		}
+
+		template<class T>
+		GCPP_NOINLINE deferred_ptr<T> make_array_uninitialized(std::size_t n) {
+			static_assert(std::is_trivially_default_constructible<T>::value
+				&& std::is_trivially_destructible<T>::value,
+				"make_array_uninitialized requires a trivial type");
+			auto p = allocate<T>(n, GCPP_RETURN_ADDRESS());
+			if (p != nullptr && compaction_enabled) {
+				store_relocator(p.get(), n, std::true_type{});
+			}
+			return p;
+		}
+
+		template<class Range, class T = std::remove_cv_t<std::remove_reference_t<
+			decltype(*std::begin(std::declval<const Range&>()))>>>
+		GCPP_NOINLINE deferred_ptr<T> make_array_from(const Range& range) {
+			using iterator = decltype(std::begin(range));
+			static_assert(std::is_base_of<std::forward_iterator_tag,
+				typename std::iterator_traits<iterator>::iterator_category>::value,
+				"make_array_from requires a range with forward iterators");
+
+			auto n = gsl::narrow_cast<int>(std::distance(std::begin(range), std::end(range)));
+			if (n == 0) {
+				return{};
+			}
+			auto p = allocate<T>(n, GCPP_RETURN_ADDRESS());
+			if (p != nullptr) {
+				auto it = std::begin(range);
+				construct_array<T>(p.get(), n, [&](T* at) { ::new (at) T(*it); ++it; });
+				if (compaction_enabled) {
+					store_relocator(p.get(), n, typename std::is_nothrow_move_constructible<T>::type{});
+				}
+			}
+			return p;
+		}
+
+		//	allocate_bytes: Allocate size uninitialized bytes aligned to align
+		//	(a power of two), for callers that only know the request at run
+		//	time. The storage is never moved by compaction, because the caller
+		//	may hand out raw pointers into it. If allocation fails, the
+		//	returned pointer will be null
+		//
+		deferred_ptr<void> allocate_bytes(std::size_t size, std::size_t align);
+
+	private:
+		//------------------------------------------------------------------------
+		//
+		//	Core allocator functions: allocate, construct, destroy
+		//	(not deallocate, which is done at collection time)
+		//
+		//	There are private, for use via deferred_allocator only
+
+		//  Helper: Return the dhpage on which this object exists.
+		//	If the object is not in our storage, returns null.
+		//	This is a lookup in pages_by_address, not a scan of the pages.
+		//
+		template<class T>
+		dhpage* find_dhpage_of(T* p) const noexcept;
 
 		template<class T>
 		std::pair<dhpage*, byte*> allocate_from_existing_pages(int n);
 
 		template<class T>
-		deferred_ptr<T> allocate(int n = 1);
+		byte* allocate_from_thread_page(thread_buffer& b, int n);
+
+		//	Whether the collect policy says to collect before adding a page
+		//	of page_bytes
+		//
+		bool should_collect_before_expand(std::size_t page_bytes) const;
+
+		template<class T>
+		deferred_ptr<T> allocate(int n = 1, const void* site = nullptr);
 
 		template<class T, class ...Args> 
 		void construct(gsl::not_null<T*> p, Args&& ...args);
 
-		template<class T> 
-		void construct_array(gsl::not_null<T*> p, int n);
+		template<class T, class Init> 
+		void construct_array(gsl::not_null<T*> p, int n, Init init);
 
 		template<class T> 
 		void destroy(gsl::not_null<T*> p) noexcept;
-		
+
+		template<class T>
+		void store_destructors(gsl::span<T> p);
+
 		bool destroy_objects(gsl::span<byte> range);
 
 		//------------------------------------------------------------------------
 		//
 		//	collect, et al.: Sweep the deferred heap
 		//
-		void mark(const deferred_ptr_void& p, std::size_t level) noexcept;
+		//	An incremental collection marks in steps between phases 2a and 3;
+		//	see begin_marking, mark_some and finish_collection
+		//
+		enum class collect_phase { idle, marking, sweeping, compacting };
+		collect_phase phase = collect_phase::idle;
+
+		//	The gray worklist: allocations that marking has reached but whose
+		//	deferred_ptrs it hasn't traced yet. Each allocation goes on it at
+		//	most once per collection, so it never needs more room than there
+		//	were allocations when marking began.
+		//
+		struct gray_allocation {
+			dhpage*		pg;
+			std::size_t	start;	// location
+		};
+		std::vector<gray_allocation> gray;
+
+		void prepare_for_marking(dhpage& pg);
+		std::size_t trace(gray_allocation g) noexcept;
+		void mark(const void* p) noexcept;
+		void shade(const void* p) noexcept;
+		void shade_unless_within(const void* p, const void* to) noexcept;
+		void begin_marking();
+		bool mark_some(std::size_t budget);
+		void finish_collection();
+
+		void release_empty_pages(std::size_t retention) noexcept;
 
 	public:
 		void collect();
 
+		//	Region-style release: destroy every object in the heap at once,
+		//	whether reachable or not, and keep the (now empty) pages for reuse.
+		//	Every deferred_ptr into the heap is first set to null, then all
+		//	pending destructors run; these must not allocate from this heap.
+		//	Any collection in progress is abandoned. In a thread-safe heap,
+		//	if another thread is collecting, this waits for it to finish and
+		//	then resets.
+		//
+		void reset();
+
+		//	Incremental collection: perform a bounded amount of the next (or
+		//	current) collection, tracing at most 'budget' objects, so that
+		//	the program can interleave its own work with marking. Returns true
+		//	when this step finished the collection. Marking preserves everything
+		//	that was reachable when it began, as well as everything allocated
+		//	since, so calling collect() at any point finishes the job.
+		//
+		//	Note: This is incremental, not concurrent: each step runs on the
+		//	calling thread (with the world stopped, in a thread-safe heap), and
+		//	no marking happens between steps. To take the steps on a helper
+		//	thread instead, see set_background_collection.
+		//
+		bool collect_step(std::size_t budget);
+
+		//	Generational collection: collect only the objects allocated since
+		//	the previous minor collection, and promote the survivors. Objects
+		//	that have been promoted are reclaimed by collect(). If an
+		//	incremental collection is underway, this finishes it instead.
+		//
+		void collect_minor();
+
+		auto get_generational() {
+			return generational;
+		}
+
+		void set_generational(bool enable = false) {
+			GCPP_EXPECTS(pages.empty()
+				&& "generational mode must be chosen before the heap is used");
+			generational = enable;
+		}
+
+		//	In generational mode, automatically run a minor collection instead
+		//	of adding a page once this many pages hold young objects (0 = never)
+		//
+		auto get_nursery_page_limit() {
+			return nursery_page_limit;
+		}
+
+		void set_nursery_page_limit(std::size_t limit = 0) {
+			nursery_page_limit = limit;
+		}
+
+		//	Compaction: collect, then move the live objects out of every page
+		//	that is less than max_occupancy full into other pages that have
+		//	room, update every deferred_ptr to them, and free the pages that
+		//	are left empty. Only objects created by make and make_array while
+		//	compaction is enabled are moved, using their move constructors,
+		//	and only if those are noexcept; other objects are pinned. (Moving
+		//	a deferred_ptr is noexcept, so deferred_ptr members don't pin.)
+		//
+		//	Note: Moving an object invalidates raw pointers and references to
+		//	it (but of course not deferred_ptrs).
+		//
+		void compact(double max_occupancy = 0.5);
+
+		auto get_compaction() {
+			return compaction_enabled;
+		}
+
+		void set_compaction(bool enable = false) {
+			compaction_enabled = enable;
+		}
+
+		//	Collect, and then return every page that is left empty to the
+		//	system regardless of the empty page retention setting
+		//
+		void shrink_to_fit();
+
+		//	When allocation collects automatically; see collect_policy.
+		//	Without a trigger, a heap that keeps growing collects only when
+		//	asked to, and collect_before_expand alone collects once per new page.
+		//
+		const collect_policy& get_collect_policy() {
+			return policy;
+		}
+
+		void set_collect_policy(collect_policy policy_ = {}) {
+			policy = std::move(policy_);
+		}
+
 		auto get_collect_before_expand() {
-			return collect_before_expand;
+			return policy.collect_before_expand;
 		}
 
 		void set_collect_before_expand(bool enable = false) {
-			collect_before_expand = enable;
+			policy.collect_before_expand = enable;
+		}
+
+		//	An empty page is released once collect() has found it empty more
+		//	than this many times in a row. The default of 0 releases empty
+		//	pages immediately; a larger value avoids repeatedly freeing and
+		//	reallocating a page on a heap whose size oscillates.
+		//
+		auto get_empty_page_retention() {
+			return empty_page_retention;
+		}
+
+		void set_empty_page_retention(std::size_t collections = 0) {
+			empty_page_retention = collections;
+		}
+
+		//	Where newly created pages get their storage from. Mapped storage
+		//	avoids touching a page's memory up front, and lets retained empty
+		//	pages give their physical memory back to the OS.
+		//
+		auto get_page_storage() {
+			return page_storage;
+		}
+
+		void set_page_storage(gpage_storage storage = gpage_storage::heap) {
+			page_storage = storage;
+		}
+
+		//	NUMA-aware placement (off by default). When on, each allocation is
+		//	made in a page created for the allocating thread's NUMA node, whose
+		//	mapped storage is bound to that node (heap storage is placed by
+		//	first touch instead); compaction keeps objects on their node; and
+		//	marking traces the collecting thread's local pages first.
+		//
+		auto get_numa_aware() {
+			return numa_aware;
+		}
+
+		void set_numa_aware(bool enable = false) {
+			numa_aware = enable;
+		}
+
+		//------------------------------------------------------------------------
+		//
+		//	Thread safety: By default a deferred_heap and its deferred_ptrs may be
+		//	used by only one thread at a time. Enable thread safety, before the
+		//	heap is used, to let several threads allocate from it and create,
+		//	copy and destroy deferred_ptrs into it concurrently.
+		//
+		//	Each thread that holds or modifies this heap's deferred_ptrs must
+		//	attach_thread() and periodically call safepoint(); collect() waits
+		//	until all other attached threads are parked at a safepoint. As usual,
+		//	unsynchronized writes to the same deferred_ptr are a race.
+		//
+		//	An attached thread allocates from a page of its own, and records
+		//	the deferred_ptrs it creates and destroys in a buffer of its own
+		//	that the heap merges now and then, so these don't contend with
+		//	other threads (except that a generational heap still takes one
+		//	lock for each). A thread that isn't attached takes the heap's lock
+		//	for each instead. Collection stops the world either way.
+		//
+		auto get_thread_safe() {
+			return thread_safe;
+		}
+
+		void set_thread_safe(bool enable = false) {
+			GCPP_EXPECTS(pages.empty() && roots.empty()
+				&& "thread safety must be chosen before the heap is used");
+			thread_safe = enable;
+		}
+
+		void attach_thread();
+		void detach_thread();
+
+		//	Cheap unless a collection is pending, in which case this blocks
+		//	until it is finished
+		//
+		void safepoint() {
+			if (stop_requested.load(std::memory_order_acquire)) {
+				std::unique_lock<std::mutex> l{ safepoint_mutex };
+				park(l);
+			}
+		}
+
+		//	Background collection (thread-safe heaps only): a helper thread
+		//	runs each collection as collect_step(budget) steps, yielding to
+		//	the program's threads in between, so that they only stop for one
+		//	step at a time and do none of the marking themselves. A collection
+		//	starts when the collect_policy's allocation_threshold is crossed
+		//	(instead of collecting on the allocating thread) or when
+		//	collect_in_background() is called.
+		//
+		//	Note: Each step still stops the world, so marking never runs in
+		//	parallel with the program; and destructors of unreachable objects
+		//	run on the helper thread.
+		//
+		auto get_background_collection() {
+			return background_thread.joinable();
+		}
+
+		void set_background_collection(bool enable = false, std::size_t budget = 1000);
+
+		//	Wake the background collector to start a collection, unless one
+		//	is already under way; returns immediately
+		//
+		void collect_in_background();
+
+		//	A snapshot of the heap's counters, for monitoring. Cheap: every
+		//	count is a running total, so this visits no pages.
+		//
+		heap_stats stats() const;
+
+		//	A number that changes whenever a collection or reset() finishes
+		//	(which may null pointers) or compaction moves objects, so that a
+		//	cache keyed by object addresses knows when to rebuild itself
+		//
+		std::size_t epoch() const noexcept {
+			return address_epoch;
+		}
+
+		//	Allocation-site profiling: record the type and the allocating code
+		//	of about one allocation in every 'interval' bytes (0 = off). At the
+		//	end of each collection, allocation_profile() then estimates how many
+		//	live bytes each site has allocated, largest first. The cost is a
+		//	subtraction per allocation, and a hash table entry per sample.
+		//
+		auto get_allocation_sampling() {
+			return sample_interval;
+		}
+
+		void set_allocation_sampling(std::size_t interval = 0) {
+			auto l = lock();
+			sample_interval = bytes_until_sample = interval;
+			if (interval == 0) {
+				samples.clear();
+				profile.clear();
+			}
+		}
+
+		std::vector<allocation_site> allocation_profile() const {
+			auto l = lock();
+			return profile;
+		}
+
+		//	Call 'observe' at the end of each phase of each collection, e.g. to
+		//	record a trace (see chrome_trace_writer). It is called while the
+		//	heap is locked, so it must not use the heap.
+		//
+		void set_collect_observer(std::function<void(const collect_event&)> observe = {}) {
+			auto l = lock();
+			observer = std::move(observe);
 		}
 
+		//	Check the heap's internal consistency and return a description of
+		//	the first problem found, or null if there is none:
+		//
+		//	- each page's allocation records are consistent (see gpage::verify)
+		//	- each deferred_ptr is tracked by the page it is in, or else as a
+		//	  root, and is attached to this heap
+		//	- each non-null deferred_ptr points to the start or middle of an
+		//	  allocation
+		//	- each destructor record lies within one allocation
+		//
+		//	The pages are checked in parallel, and the world is stopped as
+		//	for collect(). Define GCPP_VERIFY_HEAP to run this before and
+		//	after every collection, e.g. in canary builds.
+		//
+		const char* verify();
+
 		void debug_print() const;
+
+	private:
+		const char* verify_stopped() const;
+		void verify_or_fail(const char* when) const;
 	};
 
 
@@ -413,6 +1558,8 @@ namespace gcpp {
 		template<class U>
 		friend class deferred_ptr;
 
+		friend class deferred_span<T>;
+
 	public:
 		// iterator traits
 		using value_type         = T;
@@ -447,6 +1594,14 @@ namespace gcpp {
 
 		deferred_ptr& operator=(const deferred_ptr& that) noexcept = default;	// trivial copy assignment
 
+		//	Moving (leaves that null).
+		//
+		deferred_ptr(deferred_ptr&& that) noexcept
+			: deferred_ptr_void(std::move(that))
+		{ }
+
+		deferred_ptr& operator=(deferred_ptr&& that) noexcept = default;
+
 		//	Copying with conversions (base -> derived, non-const -> const).
 		//
 		template<class U, class = typename std::enable_if<std::is_convertible<U*, T*>::value, void>::type>
@@ -468,7 +1623,7 @@ namespace gcpp {
 
 		template<class U, class TT = T>	// .. TT itself is a workaround for that we can't just
 		deferred_ptr<U> ptr_to(U id_t<TT>::*pU) {	// write T:: here because <<C++ arcana>>
-			Expects(get_heap() && get() && "can't ptr_to on an unattached or null pointer");
+			GCPP_EXPECTS(get_heap() && get() && "can't ptr_to on an unattached or null pointer");
 			return{ get_heap(), &(get()->*pU) };
 		}
 
@@ -491,7 +1646,7 @@ namespace gcpp {
 		}
 
 		T* operator->() const noexcept {
-			Expects(get() && "attempt to dereference null");
+			GCPP_EXPECTS(get() && "attempt to dereference null");
 			return get();
 		}
 
@@ -505,48 +1660,47 @@ namespace gcpp {
 													
 		//	Checked pointer arithmetic
 		//
-		//	Future: This is checked in debug mode, but it might be better to split off
-		//	arithmetic into a separate array_deferred_ptr or deferred_span or suchlike
-		//	type. For now it's on deferred_ptr itself because when you instantiate
-		//	vector<T, deferred_allocator<T>> you need a pointer type that works as a
-		//	random-access iterator, and if we split this into an array_deferred_ptr type
-		//	we'll also need to make deferred_allocator use that instead... that can wait.
+		//	This is checked in debug mode. It's on deferred_ptr itself because when
+		//	you instantiate vector<T, deferred_allocator<T>> you need a pointer type
+		//	that works as a random-access iterator.
 		//
-		deferred_ptr& operator+=(int offset) noexcept {
+		//	The checks use the bounds of the allocation, which are looked up once
+		//	and then cached in the pointer (and its copies), so they are O(1).
+		//
+		//	In release builds there are no checks, but the registration cost is
+		//	the same as in debug: +=, -=, ++, -- and [] don't create a pointer,
+		//	but + and - return a new deferred_ptr, which must be registered
+		//	like any other because the caller may keep it. To iterate without
+		//	registering anything, use a deferred_span (see deferred_span.h).
+		//
+	private:
+		void check_offset(int offset) const noexcept {
 #ifndef NDEBUG
-			Expects(get() != nullptr
+			GCPP_EXPECTS(get() != nullptr
 				&& "bad deferred_ptr arithmetic: can't perform arithmetic on a null pointer");
 
-			auto this_info = get_heap()->find_dhpage_info(get());
+			auto b = bounds();
+			auto temp = (const byte*)(get() + offset);
 
-			Expects(this_info.page != nullptr
-				&& "corrupt non-null deferred_ptr, not pointing into deferred heap");
-
-			Expects(this_info.info.found > gpage::in_range_unallocated
-				&& "corrupt non-null deferred_ptr, pointing to unallocated memory");
-
-			auto temp = get() + offset;
-			auto temp_info = get_heap()->find_dhpage_info(temp);
-
-			Expects(this_info.page == temp_info.page
-				&& "bad deferred_ptr arithmetic: attempt to leave dhpage");
-
-			Expects(
+			GCPP_EXPECTS((
 				//	if this points to the start of an allocation, it's always legal
 				//	to form a pointer to the following element (just don't deref it)
 				//	which covers one-past-the-end of single-element allocations
-				(	(
-					this_info.info.found == gpage::in_range_allocated_start
-					&& (offset == -1 || offset == 0 || offset == 1)
-					)
+				(	(const byte*)get() == b.begin
+					&& (offset == -1 || offset == 0 || offset == 1))
 				//	otherwise this and temp must point into the same allocation
 				//	which is covered for arrays by the extra byte we allocated
-				||	(
-					this_info.info.start_location == temp_info.info.start_location 
-					&& temp_info.info.found > gpage::in_range_unallocated)
-					)
+				||	(b.begin <= temp && temp < b.end)
+				)
 				&& "bad deferred_ptr arithmetic: attempt to go outside the allocation");
+#else
+			(void)offset;
 #endif
+		}
+
+	public:
+		deferred_ptr& operator+=(int offset) noexcept {
+			check_offset(offset);
 			set(get() + offset);
 			return *this;
 		}
@@ -578,15 +1732,9 @@ namespace gcpp {
 		}
 
 		std::add_lvalue_reference_t<T> operator[](size_t offset) noexcept {
-#ifndef NDEBUG
-			//	In debug mode, perform the arithmetic checks by creating a temporary deferred_ptr
-			auto tmp = *this;
-			tmp += offset;	
-			return *tmp;
-#else
-			//	In release mode, don't enregister/deregister a temnporary deferred_ptr
+			//	Check without creating (and enregistering) a temporary deferred_ptr
+			check_offset(gsl::narrow_cast<int>(offset));
 			return *(get() + offset);
-#endif
 		}
 
 		ptrdiff_t operator-(const deferred_ptr& that) const noexcept {
@@ -596,23 +1744,13 @@ namespace gcpp {
 				return 0;
 			}
 
-			Expects(get() != nullptr && that.get() != nullptr
+			GCPP_EXPECTS(get() != nullptr && that.get() != nullptr
 				&& "bad deferred_ptr arithmetic: can't subtract pointers when one is null");
 
-			auto this_info = get_heap()->find_dhpage_info(get());
-			auto that_info = get_heap()->find_dhpage_info(that.get());
+			auto that_bounds = that.bounds();
+			auto here = (const byte*)get();
 
-			Expects(this_info.page != nullptr
-				&& that_info.page != nullptr
-				&& "corrupt non-null deferred_ptr, not pointing into deferred heap");
-
-			Expects(that_info.info.found > gpage::in_range_unallocated
-				&& "corrupt non-null deferred_ptr, pointing to unallocated space");
-
-			Expects(that_info.page == this_info.page
-				&& "bad deferred_ptr arithmetic: attempt to leave dhpage");
-
-			Expects(
+			GCPP_EXPECTS((
 				//	If that points to the start of an allocation, it's always legal
 				//	to form a pointer to the following element (just don't deref it)
 				//	which covers one-past-the-end of single-element allocations
@@ -620,16 +1758,12 @@ namespace gcpp {
 				//	Future: We could eliminate this first test by adding an extra byte
 				//	to every allocation, then we'd be type-safe too (this being the
 				//	only way to form a deferred_ptr<T> to something not allocated as a T)
-				((
-					that_info.info.found == gpage::in_range_allocated_start
-					&& (get() == that.get()+1)
-					)
-					//	Otherwise this and temp must point into the same allocation
-					//	which is covered for arrays by the extra byte we allocated
-					|| (
-						that_info.info.start_location == this_info.info.start_location
-						&& this_info.info.found > gpage::in_range_unallocated)
-					)
+				(	(const byte*)that.get() == that_bounds.begin
+					&& get() == that.get() + 1)
+				//	Otherwise this and that must point into the same allocation
+				//	which is covered for arrays by the extra byte we allocated
+				||	(that_bounds.begin <= here && here < that_bounds.end)
+				)
 				&& "bad deferred_ptr arithmetic: attempt to go outside the allocation");
 #endif
 
@@ -678,6 +1812,18 @@ namespace gcpp {
 			return *this;
 		}
 
+		//	Moving (leaves that null).
+		//
+		deferred_ptr(deferred_ptr&& that) noexcept
+			: deferred_ptr_void(std::move(that))
+		{ }
+
+		deferred_ptr& operator=(deferred_ptr&& that) noexcept
+		{
+			deferred_ptr_void::operator=(std::move(that));
+			return *this;
+		}
+
 		//	Copying with conversions (base -> derived, non-const -> const).
 		//
 		template<class U>
@@ -698,7 +1844,7 @@ namespace gcpp {
 		}
 
 		void* operator->() const noexcept {
-			Expects(get() && "attempt to dereference null"); 
+			GCPP_EXPECTS(get() && "attempt to dereference null"); 
 			return get(); 
 		}
 	};
@@ -706,46 +1852,260 @@ namespace gcpp {
 
 	//----------------------------------------------------------------------------
 	//
-	//	deferred_heap function implementations
+	//	deferred_weak_ptr<T>: Refers to an object in a deferred_heap without
+	//	keeping it alive. When a collection finds the object unreachable, it
+	//	sets the weak pointer to null along with the unreachable deferred_ptrs
+	//	and before running any destructor, so lock() returns either a
+	//	deferred_ptr to a live object or null.
 	//
 	//----------------------------------------------------------------------------
 	//
-	inline
-	deferred_heap::~deferred_heap() 
-	{
-		//	Note: setting this flag lets us skip worrying about reentrancy;
-		//	a destructor may not allocate a new object (which would try to
-		//	enregister and therefore change our data structures)
-		is_destroying = true;
+	template<class T>
+	class deferred_weak_ptr : public deferred_heap::deferred_weak_ptr_void {
+		template<class U>
+		friend class deferred_weak_ptr;
 
-		//	when destroying the arena, detach all pointers and run all destructors 
-		//
-		for (auto& p : roots) {
-			const_cast<deferred_ptr_void*>(p)->detach();
-		}
+	public:
+		deferred_weak_ptr() { }
 
-		for (auto& pg : pages) {
-			for (auto& p : pg.deferred_ptrs) {
-				const_cast<deferred_ptr_void*>(p.p)->detach();
-			}
+		deferred_weak_ptr(std::nullptr_t) : deferred_weak_ptr{} { }
+
+		deferred_weak_ptr& operator=(std::nullptr_t) noexcept {
+			reset();
+			return *this;
 		}
 
-		//	this calls user code (the dtors), but no reentrancy care is 
-		//	necessary per note above
-		dtors.run_all();
+		//	Observing a deferred_ptr.
+		//
+		template<class U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+		deferred_weak_ptr(const deferred_ptr<U>& that)
+			: deferred_weak_ptr_void{ that.get_heap(), static_cast<T*>(that.get()) }
+		{ }
+
+		template<class U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+		deferred_weak_ptr& operator=(const deferred_ptr<U>& that) noexcept {
+			assign(that.get_heap(), static_cast<T*>(that.get()));
+			return *this;
+		}
+
+		//	Copying, including with conversions.
+		//
+		deferred_weak_ptr(const deferred_weak_ptr&) = default;
+		deferred_weak_ptr& operator=(const deferred_weak_ptr&) = default;
+
+		template<class U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+		deferred_weak_ptr(const deferred_weak_ptr<U>& that)
+			: deferred_weak_ptr_void{ that.get_heap(), static_cast<T*>(static_cast<U*>(that.get())) }
+		{ }
+
+		//	Return a deferred_ptr that keeps the object alive, or null if the
+		//	object has been collected.
+		//
+		deferred_ptr<T> lock() const {
+			return get_heap() == nullptr ? deferred_ptr<T>{}
+				: get_heap()->lock_weak(static_cast<T*>(get()));
+		}
+
+		//	Comparisons.
+		//
+		template<class U>
+		bool operator==(const deferred_weak_ptr<U>& that) const noexcept {
+			return get() == that.get();
+		}
+
+		template<class U>
+		bool operator!=(const deferred_weak_ptr<U>& that) const noexcept {
+			return get() != that.get();
+		}
+	};
+
+
+	//----------------------------------------------------------------------------
+	//
+	//	deferred_ephemeron<K,V>: A weak key and a value that is kept alive only
+	//	while the key is reachable from elsewhere (for the collector's part, see
+	//	ephemeron_void). When the key is collected both become null. Not
+	//	copyable or movable, because the heap tracks it by address.
+	//
+	//----------------------------------------------------------------------------
+	//
+	template<class K, class V>
+	class deferred_ephemeron : public deferred_heap::ephemeron_void {
+	public:
+		deferred_ephemeron(deferred_heap& heap)
+			: ephemeron_void{ heap }
+		{ }
+
+		void set(const deferred_ptr<K>& key, const deferred_ptr<V>& value) {
+			GCPP_EXPECTS((key.get_heap() == nullptr || key.get_heap() == &get_heap())
+				&& (value.get_heap() == nullptr || value.get_heap() == &get_heap())
+				&& "cannot point an ephemeron into a different deferred_heap");
+			ephemeron_void::set(key.get(), value.get());
+		}
+
+		void reset() {
+			ephemeron_void::set(nullptr, nullptr);
+		}
+
+		//	Return deferred_ptrs that keep the key and value alive, or null if
+		//	the key has been collected.
+		//
+		deferred_ptr<K> key() const {
+			return get_heap().lock_weak(static_cast<K*>(get_key()));
+		}
+
+		deferred_ptr<V> value() const {
+			return get_heap().lock_weak(static_cast<V*>(get_value()));
+		}
+
+		//	The key's address, without keeping it alive (e.g., for indexing).
+		//
+		const K* key_address() const noexcept {
+			return static_cast<const K*>(get_key());
+		}
+	};
+
+
+	//----------------------------------------------------------------------------
+	//
+	//	deferred_heap function implementations
+	//
+	//----------------------------------------------------------------------------
+	//
+	inline
+	deferred_heap::~deferred_heap() 
+	{
+		stop_background_collector();
+		if (!thread_buffers.empty()) {
+			merge_thread_buffers();
+		}
+
+		//	Note: setting this flag lets us skip worrying about reentrancy;
+		//	a destructor may not allocate a new object (which would try to
+		//	enregister and therefore change our data structures)
+		is_destroying = true;
+
+		//	when destroying the arena, detach all pointers and run all destructors 
+		//
+		for (auto& p : roots) {
+			const_cast<deferred_ptr_void*>(p)->detach();
+		}
+
+		for (auto& pg : pages) {
+			for (auto& p : pg.deferred_ptrs) {
+				const_cast<deferred_ptr_void*>(p.p)->detach();
+			}
+		}
+
+		for (auto& p : weak_ptrs) {
+			const_cast<deferred_weak_ptr_void*>(p)->detach();
+		}
+
+		for (auto& e : ephemerons) {
+			e->detach();
+		}
+
+		//	this calls user code (the dtors), but no reentrancy care is 
+		//	necessary per note above
+		for (auto& pg : pages) {
+			pg.dtors.run_all();
+		}
 	}
 
 	//	Add this deferred_ptr to the tracking list. Invoked when constructing a deferred_ptr.
 	//
 	inline
 	void deferred_heap::enregister(const deferred_ptr_void& p) {
-		//	append it to the back of the appropriate list
-		Expects(!is_destroying 
+		GCPP_EXPECTS(!is_destroying 
 			&& "cannot allocate new objects on a deferred_heap that is being destroyed");
+
+		//	an attached thread just records it (see thread_buffer)
+		if (auto b = local_buffer()) {
+			{
+				std::lock_guard<std::mutex> hold{ b->mutex };
+				b->registrations.push_back({ &p, p.get(), true });
+				if (b->registrations.size() < buffer_records) {
+					return;
+				}
+			}
+			flush(*b);
+			return;
+		}
+
+		auto l = lock();
+		add_registration(p, p.get());
+	}
+
+	//	Remove this deferred_ptr from tracking. Invoked when destroying a deferred_ptr.
+	//
+	inline
+	void deferred_heap::deregister(const deferred_ptr_void& p) {
+		//	no need to actually deregister if we're tearing down this deferred_heap
+		if (is_destroying) 
+			return;
+
+		if (auto b = local_buffer()) {
+			{
+				std::lock_guard<std::mutex> hold{ b->mutex };
+				auto& r = b->registrations;
+
+				//	a temporary cancels out its own registration
+				if (!r.empty() && r.back().add && r.back().p == &p) {
+					if (phase == collect_phase::marking) {
+						b->shades.push_back(r.back().value);
+						b->shades.push_back(p.get());
+					}
+					r.pop_back();
+					return;
+				}
+
+				r.push_back({ &p, p.get(), false });
+				if (r.size() < buffer_records) {
+					return;
+				}
+			}
+			flush(*b);
+			return;
+		}
+
+		auto l = lock();
+		remove_registration(p, p.get());
+	}
+
+	//	Track p, which pointed to value when it was created; requires the
+	//	heap lock. Only a generational heap (which never buffers, so p is
+	//	still alive) looks at p itself.
+	//
+	inline
+	void deferred_heap::add_registration(const deferred_ptr_void& p, const void* value) {
+		//	it may already have been deregistered on another thread
+		if (!stray_removals.empty()) {
+			auto i = stray_removals.find(&p);
+			if (i != stray_removals.end()) {
+				if (--i->second == 0) {
+					stray_removals.erase(i);
+				}
+				return;
+			}
+		}
+
+		//	append it to the back of the appropriate list
 		auto pg = find_dhpage_of(&p);
 		if (pg != nullptr) 
 		{
 			pg->deferred_ptrs.push_back(&p);
+			++interior_pointers;
+
+			//	what a deferred_ptr created during marking points to must be
+			//	traced (it goes after the sorted ones, so it isn't traced itself)
+			if (phase == collect_phase::marking) {
+				shade_now_or_later(value);
+			}
+
+			//	a deferred_ptr created outside the nursery may point into it
+			if (generational && points_old_to_young(p, *pg)) {
+				remembered.insert(&p);
+			}
 		}
 		else 
 		{
@@ -753,13 +2113,14 @@ namespace gcpp {
 		}
 	}
 
-	//	Remove this deferred_ptr from tracking. Invoked when destroying a deferred_ptr.
+	//	Stop tracking p, which pointed to value when it was destroyed;
+	//	requires the heap lock
 	//
 	inline
-	void deferred_heap::deregister(const deferred_ptr_void& p) {
-		//	no need to actually deregister if we're tearing down this deferred_heap
-		if (is_destroying) 
-			return;
+	void deferred_heap::remove_registration(const deferred_ptr_void& p, const void* value) {
+		if (!remembered.empty()) {
+			remembered.erase(&p);
+		}
 
 		//	find its entry, starting from the back because it's more 
 		//	likely to be there (newer objects tend to have shorter
@@ -767,95 +2128,333 @@ namespace gcpp {
 		//	and especially temporary deferred_ptrs)
 		//
 		auto erased_count = roots.erase(&p);
-		Expects(erased_count < 2 && "duplicate registration");
+		GCPP_EXPECTS(erased_count < 2 && "duplicate registration");
 		if (erased_count > 0)
 			return;
 
-		for (auto& pg : pages) {
-			auto j = find_if(pg.deferred_ptrs.rbegin(), pg.deferred_ptrs.rend(),
+		auto pg = find_dhpage_of(&p);
+		if (pg != nullptr) {
+			auto j = find_if(pg->deferred_ptrs.rbegin(), pg->deferred_ptrs.rend(),
 				[&p](auto x) { return x.p == &p; });
-			if (j != pg.deferred_ptrs.rend()) {
-				*j = pg.deferred_ptrs.back();
-				pg.deferred_ptrs.pop_back();
+			if (j != pg->deferred_ptrs.rend()) {
+				//	while marking, keep what it pointed to (as the write barrier
+				//	does), and keep the sorted ones in order
+				auto i = gsl::narrow_cast<std::size_t>(pg->deferred_ptrs.rend() - j) - 1;
+				if (phase == collect_phase::marking) {
+					shade_now_or_later(value);
+				}
+				if (phase == collect_phase::marking && i < pg->sorted_ptrs) {
+					pg->deferred_ptrs.erase(pg->deferred_ptrs.begin() + i);
+					--pg->sorted_ptrs;
+				}
+				else {
+					*j = pg->deferred_ptrs.back();
+					pg->deferred_ptrs.pop_back();
+				}
+				--interior_pointers;
 				return;
 			}
 		}
 
-		Expects(!"attempt to deregister an unregistered deferred_ptr");
+		//	its registration may still be in another thread's buffer
+		if (thread_safe) {
+			if (phase == collect_phase::marking) {
+				shade_now_or_later(value);
+			}
+			++stray_removals[&p];
+			return;
+		}
+
+		GCPP_EXPECTS(!"attempt to deregister an unregistered deferred_ptr");
+	}
+
+	//	Add/remove a deferred_weak_ptr in its own tracking list, which marking
+	//	never looks at.
+	//
+	inline
+	void deferred_heap::enregister_weak(const deferred_weak_ptr_void& p) {
+		GCPP_EXPECTS(!is_destroying
+			&& "cannot create weak pointers on a deferred_heap that is being destroyed");
+		auto l = lock();
+		weak_ptrs.insert(&p);
+	}
+
+	inline
+	void deferred_heap::deregister_weak(const deferred_weak_ptr_void& p) {
+		//	no need to actually deregister if we're tearing down this deferred_heap
+		if (is_destroying)
+			return;
+
+		auto l = lock();
+		auto erased_count = weak_ptrs.erase(&p);
+		GCPP_EXPECTS(erased_count == 1 && "attempt to deregister an unregistered deferred_weak_ptr");
+	}
+
+	inline
+	void deferred_heap::enregister_ephemeron(ephemeron_void& e) {
+		GCPP_EXPECTS(!is_destroying
+			&& "cannot create ephemerons on a deferred_heap that is being destroyed");
+		auto l = lock();
+		ephemerons.insert(&e);
+	}
+
+	inline
+	void deferred_heap::deregister_ephemeron(ephemeron_void& e) {
+		if (is_destroying)
+			return;
+
+		auto l = lock();
+		auto erased_count = ephemerons.erase(&e);
+		GCPP_EXPECTS(erased_count == 1 && "attempt to deregister an unregistered ephemeron");
+	}
+
+	template<class T>
+	deferred_ptr<T> deferred_heap::lock_weak(T* p) {
+		//	an object that was unreachable when marking began may only be
+		//	reachable through this new deferred_ptr, so preserve it too
+		if (p != nullptr && phase == collect_phase::marking) {
+			shade(p);
+		}
+		return{ this, p };
 	}
 
 	//  Return the dhpage on which this object exists.
 	//	If the object is not in our storage, returns null.
 	//
 	template<class T>
-	deferred_heap::dhpage* deferred_heap::find_dhpage_of(T* p) noexcept {
+	deferred_heap::dhpage* deferred_heap::find_dhpage_of(T* p) const noexcept {
 		if (p != nullptr) {
-			for (auto& pg : pages) {
-				if (pg.page.contains((byte*)p))
-					return &pg;
-			}
+			//	the last page that starts at or before p is the only candidate
+			auto i = pages_by_address.upper_bound((const byte*)p);
+			if (i != pages_by_address.begin() && (--i)->second->page.contains((const byte*)p))
+				return i->second;
 		}
 		return nullptr;
 	}
 
 	template<class T>
-	deferred_heap::find_dhpage_info_ret deferred_heap::find_dhpage_info(T* p)  noexcept {
-		find_dhpage_info_ret ret;
-		for (auto& pg : pages) {
-			auto info = pg.page.contains_info((byte*)p);
-			if (info.found != gpage::not_in_range) {
-				ret.page = &pg;
-				ret.info = info;
+	std::pair<deferred_heap::dhpage*, byte*> 
+	deferred_heap::allocate_from_existing_pages(int n) {
+		auto mine = local_buffer();
+		auto try_page = [this, n, mine](dhpage& pg) -> byte* {
+			if (pg.evacuating) {
+				return nullptr;	// not where we're compacting
+			}
+			if (pg.owner != nullptr && pg.owner != mine) {
+				return nullptr;	// another thread's
+			}
+			auto before = usage_of(pg);
+			auto p = pg.page.allocate<T>(n);
+			if (p != nullptr) {
+				count_change(pg, before);
 			}
+			return p;
+		};
+
+		//	when NUMA-aware, use only pages on this thread's node
+		if (numa_aware) {
+			auto node = (std::size_t)current_numa_node();
+			if (node < pages_by_node.size()) {
+				for (auto pg : pages_by_node[node]) {
+					if (auto p = try_page(*pg))
+						return{ pg, p };
+				}
+			}
+			return{ nullptr, nullptr };
 		}
-		return ret;
-	}
 
-	template<class T>
-	std::pair<deferred_heap::dhpage*, byte*> 
-	deferred_heap::allocate_from_existing_pages(int n) {
 		for (auto& pg : pages) {
-			auto p = pg.page.allocate<T>(n);
-			if (p != nullptr)
+			if (auto p = try_page(pg))
 				return{ &pg, p };
 		}
 		return{ nullptr, nullptr };
 	}
 
+	//	Allocate from the page b's thread owns, without the heap lock;
+	//	returns null if the thread has to take the slow path instead: it has
+	//	no page or the page is full, or it has allocated enough that the
+	//	collection policy should take a look, or allocations are sampled
+	//
+	template<class T>
+	byte* deferred_heap::allocate_from_thread_page(thread_buffer& b, int n)
+	{
+		std::lock_guard<std::mutex> hold{ b.mutex };
+		auto bytes = sizeof(T) * n;
+		std::size_t limit = buffer_bytes;
+		if (policy.allocation_threshold > 0 && policy.allocation_threshold < limit) {
+			limit = policy.allocation_threshold;
+		}
+		if (b.page == nullptr || sample_interval > 0 || b.bytes_allocated + bytes > limit) {
+			return nullptr;
+		}
+
+		auto& pg = *b.page;
+		auto before = usage_of(pg);
+		auto p = pg.page.template allocate<T>(n);
+		if (p == nullptr) {
+			return nullptr;
+		}
+		count_change(pg, before, b.bytes_used, b.bytes_in_nonempty_pages, b.live_allocations);
+		++b.allocations;
+		b.bytes_allocated += bytes;
+
+		//	allocate black (see allocate)
+		if (phase != collect_phase::idle) {
+			pg.live_starts.set(pg.page.contains_info(p).start_location, true);
+		}
+		return p;
+	}
+
 	template<class T>
-	deferred_ptr<T> deferred_heap::allocate(int n) 
+	deferred_ptr<T> deferred_heap::allocate(int n, const void* site) 
 	{
-		Expects(n > 0 && "cannot request an empty allocation");
+		GCPP_EXPECTS(n > 0 && "cannot request an empty allocation");
+		GCPP_EXPECTS(!is_resetting && "cannot allocate from a deferred_heap during reset()");
+
+		auto b = local_buffer();
+		if (b != nullptr) {
+			if (auto p = allocate_from_thread_page<T>(*b, n)) {
+				return{ this, reinterpret_cast<T*>(p) };
+			}
+		}
+
+		auto l = lock();
+
+		//	bring this thread's counts (and its other records) up to date
+		if (b != nullptr) {
+			std::lock_guard<std::mutex> hold{ b->mutex };
+			merge(*b);
+		}
+
+		//	collect if enough has been allocated since the last collection...
+		bytes_since_collect += sizeof(T) * n;
+		if (policy.allocation_threshold > 0 
+			&& bytes_since_collect > policy.allocation_threshold) {
+			if (background_thread.joinable()) {
+				collect_in_background();
+			}
+			else {
+				if (l.owns_lock()) { l.unlock(); }
+				collect();
+				if (thread_safe) { l.lock(); }
+			}
+			bytes_since_collect = sizeof(T) * n;
+		}
 
-		//	get raw memory from the backing storage...
+		//	... get raw memory from the backing storage...
 		auto p = allocate_from_existing_pages<T>(n);
 
-		//	... performing a collection if necessary ...
-		if (p.second == nullptr && collect_before_expand) {
+		//	... performing a minor collection if the nursery is full ...
+		if (p.second == nullptr && generational && nursery_page_limit > 0
+			&& (std::size_t)std::count_if(pages.begin(), pages.end(),
+				[](auto& pg) { return pg.young_allocations > 0; }) >= nursery_page_limit)
+		{
+			if (l.owns_lock()) { l.unlock(); }
+			collect_minor();
+			if (thread_safe) { l.lock(); }
+			p = allocate_from_existing_pages<T>(n);
+		}
+
+		//	... performing a collection if the policy says so ...
+		//	(collect() must be able to stop the world, so don't hold the lock)
+		auto page_bytes = dhpage::template size_for<T>(n);
+		if (p.second == nullptr && should_collect_before_expand(page_bytes)) {
+			if (l.owns_lock()) { l.unlock(); }
 			collect();
+			if (thread_safe) { l.lock(); }
 			p = allocate_from_existing_pages<T>(n);
 		}
 
-		//	... allocating another page if necessary
+		//	... allocating another page if necessary, unless that would
+		//	exceed the hard cap even after collecting
 		if (p.second == nullptr) {
+			if (policy.max_heap_bytes > 0
+				&& heap_bytes + page_bytes > policy.max_heap_bytes) {
+				return{};
+			}
+
 			//	pass along the type hint for size/alignment
-			pages.emplace_back((T*)nullptr, n, this);
+			auto node = current_numa_node();
+			pages.emplace_back((T*)nullptr, n, this, node);
 			p.first = &pages.back();	// Future: just use emplace_back's return value, in a C++17 STL
+			if ((std::size_t)node >= pages_by_node.size()) {
+				pages_by_node.resize(node + 1);
+			}
+			pages_by_node[node].push_back(p.first);
+			pages_by_address[(const byte*)p.first->page.begin()] = p.first;
+			heap_bytes += p.first->page.size();
+			auto before = usage_of(*p.first);
 			p = { p.first, p.first->page.template allocate<T>(n) };
+			if (p.second != nullptr) {
+				count_change(*p.first, before);
+			}
+		}
+
+		GCPP_EXPECTS(p.second != nullptr && "failed to allocate but didn't throw an exception");
+
+		++total_allocations;
+		total_bytes_allocated += sizeof(T) * n;
+
+		//	record every sample_interval-th byte's allocation for the profiler
+		if (sample_interval > 0) {
+			if (sizeof(T) * n >= bytes_until_sample) {
+				sample(p.second, typeid(T).name(), sizeof(T) * n, site);
+				bytes_until_sample = sample_interval;
+			}
+			else {
+				bytes_until_sample -= sizeof(T) * n;
+			}
+		}
+
+		auto where = p.first->page.contains_info(p.second);
+
+		//	a new allocation is young (its location may have held an old one)
+		if (generational) {
+			p.first->old_starts.set(gsl::narrow_cast<int>(where.start_location), false);
+			++p.first->young_allocations;
+		}
+
+		//	allocate black: an object allocated during a collection survives it
+		if (phase != collect_phase::idle) {
+			p.first->live_starts.set(where.start_location, true);
+		}
+
+		//	an attached thread makes this its page to allocate from (unless
+		//	it collected meanwhile, which stopped the world)
+		b = local_buffer();
+		if (b != nullptr && p.first->owner == nullptr) {
+			if (b->page != nullptr) {
+				b->page->owner = nullptr;
+			}
+			b->page = p.first;
+			p.first->owner = b;
 		}
 
-		Expects(p.second != nullptr && "failed to allocate but didn't throw an exception");
 		return{ this, reinterpret_cast<T*>(p.second) };
 	}
 
+	inline GCPP_NOINLINE	// so that its return address is the caller's (see make)
+	deferred_ptr<void> deferred_heap::allocate_bytes(std::size_t size, std::size_t align)
+	{
+		auto site = GCPP_RETURN_ADDRESS();
+		return detail::with_aligned_unit(align, [&](auto* hint) -> deferred_ptr<void> {
+			using unit = std::remove_pointer_t<decltype(hint)>;
+			return allocate<unit>(gsl::narrow_cast<int>(
+				std::max<std::size_t>(1, (size + sizeof(unit) - 1) / sizeof(unit))), site);
+		});
+	}
+
 	template<class T, class ...Args>
 	void deferred_heap::construct(gsl::not_null<T*> p, Args&& ...args)
 	{
+		auto l = lock();
+
 		//	if there are objects with deferred destructors in this
 		//	region, run those first and remove them
 		destroy_objects({ (byte*)p.get(), sizeof(T) });
 
-		//	construct the object...
+		//	construct the object, letting other threads proceed meanwhile...
+		if (l.owns_lock()) { l.unlock(); }
 
 		//	=====================================================================
 		//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
@@ -864,42 +2463,89 @@ namespace gcpp {
 		//	=====================================================================
 
 		//	... and store the destructor
-		dtors.store(gsl::span<T>(p, 1));
+		if (thread_safe) { l.lock(); }
+		store_destructors(gsl::span<T>(p, 1));
 	}
 
-	template<class T>
-	void deferred_heap::construct_array(gsl::not_null<T*> p, int n)
+	//	Construct the n objects at p, a new allocation, with init(address)
+	//	for each, in order
+	//
+	template<class T, class Init>
+	void deferred_heap::construct_array(gsl::not_null<T*> p, int n, Init init)
 	{
-		Expects(n > 0 && "cannot request an empty array");
+		GCPP_EXPECTS(n > 0 && "cannot request an empty array");
 
 		//	if there are objects with deferred destructors in this
-		//	region, run those first and remove them
-		destroy_objects({ (byte*)p.get(), gsl::narrow_cast<int>(sizeof(T)) * n });
-
-		//	construct all the objects...
+		//	region, run those first and remove them (there can't be any in
+		//	a new allocation, because a collection runs them before it
+		//	deallocates, and an attached thread relies on that)
+		if (local_buffer() == nullptr) {
+			auto l = lock();
+			destroy_objects({ (byte*)p.get(), gsl::narrow_cast<int>(sizeof(T)) * n });
+		}
 
-		for (auto i = 0; i < n; ++i) {
-			//	=====================================================================
-			//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
-			::new (p) T{};
-			//  === END REENTRANCY-SAFE: reload any stored copies of private state
-			//	=====================================================================
+		//	construct all the objects, letting other threads proceed meanwhile...
+		auto i = 0;
+		try {
+			for (; i < n; ++i) {
+				//	=====================================================================
+				//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
+				init(p.get() + i);
+				//  === END REENTRANCY-SAFE: reload any stored copies of private state
+				//	=====================================================================
+			}
+		}
+		catch (...) {
+			//	no destructor has been stored yet, so destroy the objects that
+			//	were constructed (in reverse order) before passing it on; the
+			//	storage is reclaimed by the next collection
+			while (i > 0) {
+				(p.get() + --i)->~T();
+			}
+			throw;
 		}
 
-		//	... and store the destructor
-		dtors.store(gsl::span<T>(p, n));
+		//	... and store the destructor, in the thread's buffer if it has one
+		if (auto b = local_buffer()) {
+			std::lock_guard<std::mutex> hold{ b->mutex };
+			b->dtors.store(gsl::span<T>(p, n));
+			return;
+		}
+		auto l = lock();
+		store_destructors(gsl::span<T>(p, n));
 	}
 
 	template<class T>
 	void deferred_heap::destroy(gsl::not_null<T*> p) noexcept
 	{
-		Expects((p == nullptr || dtors.is_stored(p))
+		auto l = lock();
+		GCPP_AUDIT((p == nullptr || (find_dhpage_of(p.get()) != nullptr
+									 && find_dhpage_of(p.get())->dtors.is_stored(p)))
 			&& "attempt to destroy an object whose destructor is not registered");
 	}
 
+	//	Store the destructors for the objects in p with their page
+	//
+	template<class T>
+	void deferred_heap::store_destructors(gsl::span<T> p) {
+		auto& dtors = find_dhpage_of(&*p.begin())->dtors;
+		auto before = dtors.size();
+		dtors.store(p);
+		pending_destructors += dtors.size() - before;
+	}
+
+	//	Run the destructors for the objects in range, which is in one page,
+	//	so only that page's records are searched
+	//
 	inline
 	bool deferred_heap::destroy_objects(gsl::span<byte> range) {
-		return dtors.run(range);
+		auto pg = range.size() > 0 ? find_dhpage_of(&*range.begin()) : nullptr;
+		if (pg == nullptr) {
+			return false;
+		}
+		auto destroyed = pg->dtors.run(range);
+		pending_destructors -= destroyed;
+		return destroyed > 0;
 	}
 
 	//------------------------------------------------------------------------
@@ -907,72 +2553,243 @@ namespace gcpp {
 	//	collect, et al.: Sweep the deferred heap
 	//
 	inline
-	void deferred_heap::mark(const deferred_ptr_void& p, std::size_t level) noexcept
+	void deferred_heap::mark(const void* p) noexcept
 	{
 		//	if it isn't null ...
-		if (p.get() == nullptr)
+		if (p == nullptr)
 			return;
 
 		// ... find which page it points into ...
-		for (auto& pg : pages) {
-			auto where = pg.page.contains_info((byte*)p.get());
-			Expects(where.found != gpage::in_range_unallocated
-				&& "must not point to unallocated memory");
-			if (where.found != gpage::not_in_range) {
-				// ... and mark the chunk as live ...
-				pg.live_starts.set(where.start_location, true);
-
-				// ... and mark any deferred_ptrs in the allocation as reachable
-				for (auto& dp : pg.deferred_ptrs) {
-					auto dp_where = pg.page.contains_info((byte*)dp.p);
-					Expects((dp_where.found == gpage::in_range_allocated_middle
-						|| dp_where.found == gpage::in_range_allocated_start)
-						&& "points to unallocated memory");
-					if (dp_where.start_location == where.start_location
-						&& dp.level == 0) {
-						dp.level = level;	// 'level' steps from a root
-					}
-				}
-				break;
-			}
-		}
-	}
+		auto pg = find_dhpage_of(p);
+		if (pg == nullptr)
+			return;
+		auto where = pg->page.contains_info((const byte*)p);
+		GCPP_EXPECTS(where.found != gpage::in_range_unallocated
+			&& "must not point to unallocated memory");
 
+		// ... (a minor collection treats everything outside the nursery
+		// as live, and doesn't trace through it) ...
+		if (minor_in_progress && pg->old_starts.get(gsl::narrow_cast<int>(where.start_location)))
+			return;
+
+		// ... and mark the chunk as live, unless it already is (in which
+		// case it is already on the worklist or has been traced) ...
+		if (pg->live_starts.get(where.start_location))
+			return;
+		++objects_marked;
+		pg->live_starts.set(where.start_location, true);
+
+		// ... and leave its deferred_ptrs to be traced (there's room, see gray)
+		gray.push_back({ pg, where.start_location });
+	}
+
+	//	Mark what each deferred_ptr in g's allocation points to, and return
+	//	how many there were
+	//
 	inline
-	void deferred_heap::collect()
+	std::size_t deferred_heap::trace(gray_allocation g) noexcept
 	{
-		//	1. reset all the mark bits and in-arena deferred_ptr levels
-		//
-		for (auto& pg : pages) {
-			pg.live_starts.set_all(false);
-			for (auto& dp : pg.deferred_ptrs) {
-				dp.level = 0;
+		auto& ptrs = g.pg->deferred_ptrs;
+		auto begin = (const byte*)g.pg->page.location_info(gsl::narrow_cast<int>(g.start)).pointer;
+		auto end = (const byte*)g.pg->page.allocation_end(g.start);
+
+		std::size_t ret = 0;
+		auto dp = std::partition_point(ptrs.begin(), ptrs.begin() + g.pg->sorted_ptrs,
+			[=](auto& x) { return (const byte*)x.p < begin; });
+		for (; dp != ptrs.begin() + g.pg->sorted_ptrs && (const byte*)dp->p < end; ++dp) {
+			mark(dp->p->get());
+			++ret;
+		}
+		return ret;
+	}
+
+	inline
+	bool deferred_heap::is_reached(const void* p) const noexcept
+	{
+		auto pg = find_dhpage_of(p);
+		if (pg == nullptr) {
+			return true;	// not ours to collect
+		}
+		auto start = gsl::narrow_cast<int>(pg->page.contains_info((const byte*)p).start_location);
+		return (minor_in_progress && pg->old_starts.get(start))
+			|| pg->live_starts.get(start);
+	}
+
+	//	The write barrier: while marking is in progress, the pointee of a
+	//	deferred_ptr that is about to be overwritten or nulled must be kept,
+	//	because it was reachable when marking began (snapshot-at-the-beginning).
+	//	It goes on the gray worklist, so its own deferred_ptrs will be traced
+	//	by a later marking step.
+	//
+	inline
+	void deferred_heap::shade(const void* p) noexcept
+	{
+		if (auto b = local_buffer()) {
+			{
+				std::lock_guard<std::mutex> hold{ b->mutex };
+				b->shades.push_back(p);
+				if (b->shades.size() < buffer_records) {
+					return;
+				}
 			}
+			flush(*b);
+			return;
 		}
 
-		//	2. mark all roots + the in-arena deferred_ptrs reachable from them
-		//
-		std::size_t level = 1;
+		auto l = lock();
+		if (phase == collect_phase::marking) {
+			shade_now_or_later(p);
+		}
+	}
+
+	//	Mark p, unless other threads are running: then they may be
+	//	allocating in the same pages, so it waits until the world is stopped
+	//	for the next marking step. Requires the heap lock.
+	//
+	inline
+	void deferred_heap::shade_now_or_later(const void* p) noexcept
+	{
+		if (thread_safe && !world_stopped) {
+			pending_shades.push_back(p);
+		}
+		else {
+			mark(p);
+		}
+	}
+
+	//	The write barrier for repointing a deferred_ptr from p to 'to', which
+	//	is only needed if 'to' is not in the same allocation as p
+	//
+	inline
+	void deferred_heap::shade_unless_within(const void* p, const void* to) noexcept
+	{
+		if (local_buffer() != nullptr) {
+			shade(p);	// don't look at the page
+			return;
+		}
+
+		auto l = lock();
+		if (phase != collect_phase::marking) {
+			return;
+		}
+		auto pg = find_dhpage_of(p);
+		if (pg != nullptr && to != nullptr && pg->owner == nullptr) {	// (not another thread's)
+			auto from_where = pg->page.contains_info((const byte*)p);
+			auto to_where = pg->page.contains_info((const byte*)to);
+			if (to_where.found > gpage::in_range_unallocated
+				&& to_where.start_location == from_where.start_location) {
+				return;
+			}
+		}
+		shade_now_or_later(p);
+	}
+
+	//	Reset pg's mark bits, and sort its deferred_ptrs for trace
+	//
+	inline
+	void deferred_heap::prepare_for_marking(dhpage& pg)
+	{
+		pg.live_starts.set_all(false);
+		std::sort(pg.deferred_ptrs.begin(), pg.deferred_ptrs.end(),
+			[](auto& a, auto& b) { return std::less<const void*>{}(a.p, b.p); });
+		pg.sorted_ptrs = pg.deferred_ptrs.size();
+	}
+
+	//	1. reset all the mark bits and sort the in-arena deferred_ptrs, and
+	//	2a. mark all roots (this is the snapshot that marking will preserve)
+	//
+	inline
+	void deferred_heap::begin_marking()
+	{
+		GCPP_EXPECTS(phase == collect_phase::idle && "marking already in progress");
+		verify_or_fail("before collection");
+
+		this_pause = {};
+		auto phase_start = clock::now();
+		std::size_t reset = 0;
+
+		gray.clear();
+		gray.reserve(live_allocations);
+		for (auto& pg : pages) {
+			prepare_for_marking(pg);
+			reset += pg.deferred_ptrs.size();
+		}
+		for (auto& e : ephemerons) {
+			e->traced = false;
+		}
+
+		end_phase("reset", &collect_pause::reset, phase_start, reset, 0);
+		phase_start = clock::now();
+		objects_marked = 0;
+
 		for (auto& p : roots) {
-			mark(*p, level);	// mark this deferred_ptr root
+			mark(p->get());	// mark this deferred_ptr root
 		}
 
-		bool done = false;
-		while (!done) {
-			done = true;	// we're done unless we find another to mark
-			++level;
-			for (auto& pg : pages) {
-				for (auto& dp : pg.deferred_ptrs) {
-					if (dp.level == level - 1) {
-						done = false;
-						mark(*(dp.p), level);	// mark this reachable in-arena deferred_ptr
-					}
+		end_phase("mark", &collect_pause::mark, phase_start, objects_marked, roots.size());
+		phase = collect_phase::marking;
+	}
+
+	//	2b. mark the in-arena deferred_ptrs reachable from the roots, tracing
+	//	at most 'budget' allocations from the gray worklist. Returns true if
+	//	marking is complete.
+	//
+	//	Between steps, the program is free to create, destroy, and (behind
+	//	the write barrier) assign deferred_ptrs; anything that would lose an
+	//	object reachable when marking began puts it on the worklist.
+	//
+	inline
+	bool deferred_heap::mark_some(std::size_t budget)
+	{
+		GCPP_EXPECTS(phase == collect_phase::marking && "marking is not in progress");
+
+		auto phase_start = clock::now();
+		objects_marked = 0;
+		std::size_t traced = 0;
+
+		for (;;) {
+			while (!gray.empty()) {
+				if (budget-- == 0) {
+					end_phase("mark", &collect_pause::mark, phase_start, objects_marked, traced);
+					return false;
+				}
+				auto g = gray.back();
+				gray.pop_back();
+				traced += trace(g);
+			}
+
+			//	once nothing else is left to trace, trace the value of each
+			//	ephemeron whose key has now been reached, as if from a root
+			//	... unless the ephemeron is in an allocation not reached yet
+			bool done = true;
+			for (auto& e : ephemerons) {
+				if (!e->traced && e->key != nullptr && is_reached(e->key) && is_reached(e)) {
+					done = false;
+					e->traced = true;
+					++traced;
+					mark(e->value);
 				}
 			}
+			if (done) {
+				end_phase("mark", &collect_pause::mark, phase_start, objects_marked, traced);
+				return true;
+			}
 		}
+	}
+
+	//	We have now marked every allocation to save, so now
+	//	go through and clean up all the unreachable objects
+	//
+	inline
+	void deferred_heap::finish_collection()
+	{
+		GCPP_EXPECTS(phase == collect_phase::marking && "marking is not in progress");
 
-		//	We have now marked every allocation to save, so now
-		//	go through and clean up all the unreachable objects
+		//	from here on, allocations made by destructors must not be swept
+		//	(see allocate), but there is nothing left for the write barrier to do
+		phase = collect_phase::sweeping;
+		auto phase_start = clock::now();
+		std::size_t visited = 0;
 
 		//	3. reset all unreached deferred_ptrs to null
 		//	
@@ -1006,72 +2823,1243 @@ namespace gcpp {
 		//	the rule "deferred_ptrs can be null in dtors."
 		//
 		for (auto& pg : pages) {
+			if (minor_in_progress && pg.young_allocations == 0) {
+				continue;
+			}
 			for (auto& dp : pg.deferred_ptrs) {
-				if (dp.level == 0) {
+				if (!is_reached(dp.p)) {	// in an allocation we're about to destroy
 					const_cast<deferred_ptr_void*>(dp.p)->reset();
+					++visited;
 				}
 			}
 		}
 
+		//	... and all deferred_weak_ptrs to objects we're about to destroy,
+		//	and ephemerons whose keys (or themselves) we're about to destroy
+		for (auto& wp : weak_ptrs) {
+			if (wp->p != nullptr && !is_reached(wp->p)) {
+				const_cast<deferred_weak_ptr_void*>(wp)->reset();
+				++visited;
+			}
+		}
+		for (auto& e : ephemerons) {
+			if (e->key != nullptr && (!is_reached(e->key) || !is_reached(e))) {
+				e->key = e->value = nullptr;
+				++visited;
+			}
+		}
+
+		end_phase("null", &collect_pause::null, phase_start, visited, 0);
+		phase_start = clock::now();
+		visited = 0;
+
 		//	4. deallocate all unreachable allocations, running
 		//	destructors if registered
 		//
 		for (auto& pg : pages) {
+			if (minor_in_progress && pg.young_allocations == 0) {
+				continue;
+			}
+
 			for (auto i = 0; i < pg.page.locations(); ++i) {
 				auto start = pg.page.location_info(i);
 				if (start.is_start && !pg.live_starts.get(i)) {
-					//	this is an allocation to destroy and deallocate
-
-					//	find the end of the allocation
-					auto end_i = i + 1;
-					auto end = pg.page.location_info(pg.page.locations()).pointer;
-					for (; end_i < pg.page.locations(); ++end_i) {
-						auto info = pg.page.location_info(end_i);
-						if (info.is_start) {
-							end = info.pointer;
-							break;
-						}
+					auto old = pg.old_starts.get(i);
+					if (minor_in_progress && old) {
+						continue;	// outside the nursery
 					}
 
-					// call the destructors for objects in this range
-					destroy_objects({ start.pointer, end - start.pointer });
+					//	this is an allocation to destroy and deallocate;
+					//	optimization: skip looking for destructors once
+					//	there are none left in this page
+					if (pg.dtors.size() > 0) {
+						//	find the end of the allocation
+						auto end_i = i + 1;
+						auto end = pg.page.location_info(pg.page.locations()).pointer;
+						for (; end_i < pg.page.locations(); ++end_i) {
+							auto info = pg.page.location_info(end_i);
+							if (info.is_start) {
+								end = info.pointer;
+								break;
+							}
+						}
+
+						// call the destructors for objects in this range
+						destroy_objects({ start.pointer, end - start.pointer });
+					}
 
 					// and then deallocate the raw storage
+					auto before = usage_of(pg);
 					pg.page.deallocate(start.pointer);
+					bytes_freed += before.bytes - pg.page.bytes_in_use();
+					count_change(pg, before);
+					++visited;
+					if (generational && !old) {
+						--pg.young_allocations;
+					}
+					if (!relocators.empty()) {
+						relocators.erase(start.pointer);
+					}
+					if (!samples.empty()) {
+						samples.erase(start.pointer);
+					}
 				}
 			}
 		}
 
+		//	5. return pages that have stayed empty long enough
+		//
+		release_empty_pages(empty_page_retention);
+
+		//	6. note what's left, for the automatic collection triggers
+		//
+		bytes_since_collect = 0;
+		live_bytes_after_collect = 0;
+		for (auto& pg : pages) {
+			live_bytes_after_collect += pg.page.bytes_in_use();
+		}
+
+		if (sample_interval > 0) {
+			update_profile();
+		}
+
+		end_phase("sweep", &collect_pause::sweep, phase_start, visited, 0);
+		last_pause = this_pause;
+		total_pause += this_pause;
+		++collections;
+		if (minor_in_progress) {
+			++minor_collections;
+		}
+		++address_epoch;
+
+		phase = collect_phase::idle;
+		verify_or_fail("after collection");
 	}
 
 	inline
-	void destructors::debug_print() const {
-		std::cout << "\n  destructors size() is " << dtors.size() << "\n";
-		for (auto& d : dtors) {
-			std::cout << "    " << (void*)(d.p) << ", " << (void*)(d.destroy) << "\n";
+	void deferred_heap::collect()
+	{
+		//	if other threads use this heap, wait until they are all stopped
+		//	(if another thread got there first, its collection will do)
+		//
+		if (thread_safe && !stop_the_world()) {
+			return;
 		}
-		std::cout << "\n";
+		auto l = lock();
+
+		//	a destructor (or move constructor, when compacting) run by this
+		//	collection can't start another one
+		if (phase == collect_phase::idle || phase == collect_phase::marking) {
+			//	finish any incremental collection that is underway
+			if (phase == collect_phase::idle) {
+				begin_marking();
+			}
+			mark_some(std::numeric_limits<std::size_t>::max());
+			finish_collection();
+		}
+
+		if (thread_safe) {
+			l.unlock();
+			resume_the_world();
+		}
+	}
+
+	inline
+	void deferred_heap::reset()
+	{
+		if (thread_safe && !stop_the_world()) {
+			reset();	// another thread was collecting, so now it's our turn
+			return;
+		}
+		auto l = lock();
+		is_resetting = true;
+		phase = collect_phase::sweeping;
+		gray.clear();
+
+		//	null every deferred_ptr first, so that no destructor can reach
+		//	another object that may already have been destroyed (as in collect)
+		for (auto& p : roots) {
+			const_cast<deferred_ptr_void*>(p)->reset();
+		}
+		for (auto& pg : pages) {
+			for (auto& dp : pg.deferred_ptrs) {
+				const_cast<deferred_ptr_void*>(dp.p)->reset();
+			}
+		}
+		for (auto& wp : weak_ptrs) {
+			const_cast<deferred_weak_ptr_void*>(wp)->reset();
+		}
+		for (auto& e : ephemerons) {
+			e->key = e->value = nullptr;
+		}
+
+		//	=====================================================================
+		//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
+		for (auto& pg : pages) {
+			pg.dtors.run_all();
+		}
+		//  === END REENTRANCY-SAFE: reload any stored copies of private state
+		//	=====================================================================
+
+		//	now empty every page in one go
+		for (auto& pg : pages) {
+			bytes_freed += pg.page.bytes_in_use();
+			pg.page.clear();
+			pg.live_starts.set_all(false);
+			pg.deferred_ptrs.clear();
+			pg.old_starts.set_all(false);
+			pg.young_allocations = 0;
+			pg.evacuating = false;
+		}
+		bytes_used = 0;
+		bytes_in_nonempty_pages = 0;
+		live_allocations = 0;
+		interior_pointers = 0;
+		pending_destructors = 0;
+		remembered.clear();
+		relocators.clear();
+		samples.clear();
+		if (sample_interval > 0) {
+			update_profile();
+		}
+		bytes_since_collect = 0;
+		live_bytes_after_collect = 0;
+		++address_epoch;
+
+		phase = collect_phase::idle;
+		is_resetting = false;
+
+		if (thread_safe) {
+			l.unlock();
+			resume_the_world();
+		}
+	}
+
+	inline
+	bool deferred_heap::collect_step(std::size_t budget)
+	{
+		if (thread_safe && !stop_the_world()) {
+			return false;
+		}
+		auto l = lock();
+
+		bool done = false;
+		if (phase == collect_phase::idle || phase == collect_phase::marking) {
+			if (phase == collect_phase::idle) {
+				begin_marking();
+			}
+			done = mark_some(budget);
+			if (done) {
+				finish_collection();
+			}
+		}
+
+		if (thread_safe) {
+			l.unlock();
+			resume_the_world();
+		}
+		return done;
+	}
+
+	inline
+	void deferred_heap::collect_minor()
+	{
+		GCPP_EXPECTS(generational && "minor collections require generational mode");
+
+		if (thread_safe && !stop_the_world()) {
+			return;
+		}
+		auto l = lock();
+
+		if (phase == collect_phase::marking) {
+			mark_some(std::numeric_limits<std::size_t>::max());
+			finish_collection();
+		}
+		else if (phase == collect_phase::idle) {
+			verify_or_fail("before minor collection");
+			minor_in_progress = true;
+			this_pause = {};
+			auto phase_start = clock::now();
+			std::size_t visited = 0;
+
+			//	1. reset the mark bits and sort the deferred_ptrs in the nursery
+			//
+			gray.clear();
+			gray.reserve(live_allocations);
+			for (auto& pg : pages) {
+				if (pg.young_allocations > 0) {
+					prepare_for_marking(pg);
+					visited += pg.deferred_ptrs.size();
+				}
+				else {
+					pg.sorted_ptrs = 0;	// nothing here will be traced
+				}
+			}
+
+			end_phase("reset", &collect_pause::reset, phase_start, visited, 0);
+			phase_start = clock::now();
+			objects_marked = 0;
+			std::size_t traced = roots.size();
+
+			//	2. mark the nursery objects reachable from the roots and from
+			//	remembered deferred_ptrs that are (still) outside the nursery,
+			//	and then the ones reachable from those
+			//
+			for (auto& p : roots) {
+				mark(p->get());
+			}
+			for (auto& p : remembered) {
+				mark(p->get());
+				++traced;
+			}
+			end_phase("mark", &collect_pause::mark, phase_start, objects_marked, traced);
+			phase = collect_phase::marking;
+			mark_some(std::numeric_limits<std::size_t>::max());
+
+			//	3.-5. as for a full collection, but only in the nursery
+			//
+			finish_collection();
+
+			//	6. promote the survivors; now nothing outside the nursery
+			//	points into it
+			//
+			for (auto& pg : pages) {
+				if (pg.young_allocations == 0) {
+					continue;
+				}
+				for (auto i = 0; i < pg.page.locations(); ++i) {
+					if (pg.page.location_info(i).is_start) {
+						pg.old_starts.set(i, true);
+					}
+				}
+				pg.young_allocations = 0;
+			}
+			remembered.clear();
+
+			minor_in_progress = false;
+		}
+
+		if (thread_safe) {
+			l.unlock();
+			resume_the_world();
+		}
+	}
+
+	//	The generational write barrier: remember a deferred_ptr that was just
+	//	assigned if it is in a promoted allocation and now points into the
+	//	nursery. Both are page lookups, so this is cheap for the common
+	//	young-to-young and old-to-old assignments, which are not remembered.
+	//
+	inline
+	void deferred_heap::remember(const deferred_ptr_void& p)
+	{
+		if (p.get() == nullptr) {
+			return;
+		}
+		auto l = lock();
+		auto from = find_dhpage_of(&p);
+		if (from != nullptr && points_old_to_young(p, *from)) {
+			remembered.insert(&p);
+		}
+	}
+
+	//	Whether p, which is in page 'from', is in a promoted allocation and
+	//	points to a young one
+	//
+	inline
+	bool deferred_heap::points_old_to_young(const deferred_ptr_void& p, const dhpage& from) const noexcept
+	{
+		if (!from.in_old_allocation(&p)) {
+			return false;
+		}
+		auto to = find_dhpage_of(p.get());
+		return to != nullptr && !to->in_old_allocation(p.get());
+	}
+
+	//	Recompute the remembered set from scratch, after objects have moved
+	//
+	inline
+	void deferred_heap::rebuild_remembered()
+	{
+		remembered.clear();
+		for (auto& pg : pages) {
+			for (auto& dp : pg.deferred_ptrs) {
+				if (points_old_to_young(*dp.p, pg)) {
+					remembered.insert(dp.p);
+				}
+			}
+		}
+	}
+
+	template<class T>
+	void deferred_heap::store_relocator(T* p, int n, std::true_type)
+	{
+		auto l = lock();
+		relocators[(byte*)p] = {
+			n,
+			[](gpage& page, int count) { return page.allocate<T>(count); },
+			[](void* from, void* to, int count) {
+				for (auto i = 0; i < count; ++i) {
+					//	=============================================================
+					//  === BEGIN REENTRANCY-SAFE: ensure no in-progress use of private state
+					::new ((T*)to + i) T(std::move(((T*)from)[i]));
+					((T*)from)[i].~T();
+					//  === END REENTRANCY-SAFE: reload any stored copies of private state
+					//	=============================================================
+				}
+			}
+		};
+	}
+
+	inline
+	void deferred_heap::compact(double max_occupancy)
+	{
+		collect();
+
+		if (thread_safe && !stop_the_world()) {
+			return;
+		}
+		auto l = lock();
+
+		if (phase == collect_phase::idle) {
+			phase = collect_phase::compacting;
+			evacuate(max_occupancy);
+			phase = collect_phase::idle;
+			release_empty_pages(0);
+			verify_or_fail("after compaction");
+		}
+
+		if (thread_safe) {
+			l.unlock();
+			resume_the_world();
+		}
+	}
+
+	inline
+	void deferred_heap::evacuate(double max_occupancy)
+	{
+		//	1. choose the pages to empty: the sparsest first, for as long as
+		//	the rest of the pages have room for what's in them (in bytes,
+		//	because pages have different location sizes)
+		//
+		std::vector<dhpage*> sparse;
+		std::size_t room = 0;
+		for (auto& pg : pages) {
+			room += pg.page.size() - pg.page.bytes_in_use();
+			if (!pg.page.is_empty()
+				&& pg.page.bytes_in_use() < max_occupancy * pg.page.size()) {
+				sparse.push_back(&pg);
+			}
+		}
+
+		std::sort(sparse.begin(), sparse.end(), [](auto a, auto b) {
+			return (double)a->page.bytes_in_use() / a->page.size()
+				 < (double)b->page.bytes_in_use() / b->page.size();
+		});
+
+		for (auto pg : sparse) {
+			//	emptying this page takes away its free space, and needs room
+			//	elsewhere for what's in it
+			if (room < pg->page.size()) {
+				break;
+			}
+			room -= pg->page.size();
+			pg->evacuating = true;
+		}
+
+		//	2. move each movable allocation out of them, into the first other
+		//	page with room, keeping its generation ... we never add pages in
+		//	order to compact
+		//
+		struct move_record {
+			const byte* begin;	// old [begin,end)
+			const byte* end;
+			byte*		to;		// new begin
+		};
+		std::vector<move_record> moves;
+
+		for (auto& src : pages) {
+			if (!src.evacuating) {
+				continue;
+			}
+			for (auto i = 0; i < src.page.locations(); ++i) {
+				auto start = src.page.location_info(i);
+				if (!start.is_start) {
+					continue;
+				}
+				auto r = relocators.find(start.pointer);
+				if (r == relocators.end()) {
+					continue;	// pinned
+				}
+				auto reloc = r->second;
+
+				byte* to = nullptr;
+				dhpage* to_page = nullptr;
+				for (auto& dst : pages) {
+					if (dst.evacuating || (numa_aware && dst.node != src.node)) {
+						continue;
+					}
+					auto before = usage_of(dst);
+					to = reloc.allocate_in(dst.page, reloc.count);
+					if (to != nullptr) {
+						count_change(dst, before);
+						to_page = &dst;
+						if (generational) {
+							auto old = src.old_starts.get(i);
+							dst.old_starts.set(gsl::narrow_cast<int>(
+								dst.page.contains_info(to).start_location), old);
+							if (!old) {
+								--src.young_allocations;
+								++dst.young_allocations;
+							}
+						}
+						break;
+					}
+				}
+				if (to == nullptr) {
+					continue;	// nowhere to put it
+				}
+
+				//	find the end of the allocation
+				auto end = src.page.location_info(src.page.locations()).pointer;
+				for (auto end_i = i + 1; end_i < src.page.locations(); ++end_i) {
+					auto info = src.page.location_info(end_i);
+					if (info.is_start) {
+						end = info.pointer;
+						break;
+					}
+				}
+
+				//	(this may throw, so do it before anything moves)
+				src.dtors.move_to({ start.pointer, end - start.pointer }, to, to_page->dtors);
+				relocators.erase(r);
+				reloc.relocate(start.pointer, to, reloc.count);
+				relocators[to] = reloc;
+				auto s = samples.find(start.pointer);
+				if (s != samples.end()) {
+					samples[to] = s->second;
+					samples.erase(start.pointer);
+				}
+				auto before = usage_of(src);
+				src.page.deallocate(start.pointer);
+				count_change(src, before);
+				moves.push_back({ start.pointer, end, to });
+			}
+		}
+
+		for (auto& pg : pages) {
+			pg.evacuating = false;
+		}
+
+		if (moves.empty()) {
+			return;
+		}
+
+		//	3. update every deferred_ptr into a moved allocation (including the
+		//	ones in the moved objects themselves, which were copied from the
+		//	originals); see the note on const_cast in finish_collection
+		//
+		std::sort(moves.begin(), moves.end(),
+			[](auto& a, auto& b) { return a.begin < b.begin; });
+
+		auto update = [&](void*& ptr) {
+			auto p = (const byte*)ptr;
+			auto m = std::upper_bound(moves.begin(), moves.end(), p,
+				[](auto p, auto& m) { return p < m.begin; });
+			if (m != moves.begin() && p < (--m)->end) {
+				ptr = m->to + (p - m->begin);
+				return true;
+			}
+			return false;
+		};
+
+		for (auto& p : roots) {
+			if (update(const_cast<deferred_ptr_void*>(p)->p)) {
+				p->forget_bounds();
+			}
+		}
+		for (auto& pg : pages) {
+			for (auto& dp : pg.deferred_ptrs) {
+				if (update(const_cast<deferred_ptr_void*>(dp.p)->p)) {
+					dp.p->forget_bounds();
+				}
+			}
+		}
+		for (auto& wp : weak_ptrs) {
+			update(const_cast<deferred_weak_ptr_void*>(wp)->p);
+		}
+		for (auto& e : ephemerons) {
+			update(e->key);
+			update(e->value);
+		}
+
+		//	the moved objects' deferred_ptrs were re-registered at their new
+		//	addresses, before the pointers into moved objects were updated
+		if (generational) {
+			rebuild_remembered();
+		}
+
+		//	only now is every address up to date (the move constructors
+		//	above may have looked at an address-keyed cache)
+		++address_epoch;
+	}
+
+	inline
+	void deferred_heap::shrink_to_fit()
+	{
+		collect();
+		auto l = lock();
+		release_empty_pages(0);
+	}
+
+	//------------------------------------------------------------------------
+	//
+	//	Thread safety: attaching threads, safepoints and stopping the world
+	//
+	inline
+	bool deferred_heap::is_attached_thread() const {
+		auto& heaps = attached_heaps();
+		return std::find_if(heaps.begin(), heaps.end(),
+			[this](auto& h) { return h.first == this; }) != heaps.end();
+	}
+
+	//	The calling thread's buffer, unless it isn't attached (or this heap
+	//	doesn't buffer), or it has stopped the world to work on the heap
+	//
+	inline
+	deferred_heap::thread_buffer* deferred_heap::local_buffer() const noexcept {
+		if (!thread_safe || generational || world_stopped.load(std::memory_order_relaxed)) {
+			return nullptr;
+		}
+		for (auto& h : attached_heaps()) {
+			if (h.first == this) {
+				return h.second;
+			}
+		}
+		return nullptr;
+	}
+
+	inline
+	void deferred_heap::attach_thread() {
+		GCPP_EXPECTS(thread_safe && "attach_thread requires a thread-safe heap");
+		GCPP_EXPECTS(!is_attached_thread() && "this thread is already attached");
+		thread_buffer* b;
+		{
+			auto l = lock();
+			thread_buffers.emplace_back();
+			b = &thread_buffers.back();
+		}
+		std::unique_lock<std::mutex> l{ safepoint_mutex };
+		park(l);	// don't join in the middle of a collection
+		++attached_threads;
+		attached_heaps().push_back({ this, b });
+	}
+
+	inline
+	void deferred_heap::detach_thread() {
+		GCPP_EXPECTS(is_attached_thread() && "this thread is not attached");
+		auto& heaps = attached_heaps();
+		auto mine = std::find_if(heaps.begin(), heaps.end(),
+			[this](auto& h) { return h.first == this; });
+		{
+			auto l = lock();
+			auto& b = *mine->second;
+			{
+				std::lock_guard<std::mutex> hold{ b.mutex };
+				merge(b);
+			}
+			if (b.page != nullptr) {
+				b.page->owner = nullptr;
+			}
+			thread_buffers.erase(std::find_if(thread_buffers.begin(), thread_buffers.end(),
+				[&b](auto& x) { return &x == &b; }));
+		}
+		{
+			std::lock_guard<std::mutex> l{ safepoint_mutex };
+			--attached_threads;
+			heaps.erase(mine);
+		}
+		safepoint_cv.notify_all();	// a collector may be waiting for us
+	}
+
+	//	Merge b into the heap, from b's thread
+	//
+	inline
+	void deferred_heap::flush(thread_buffer& b) {
+		auto l = lock();
+		std::lock_guard<std::mutex> hold{ b.mutex };
+		merge(b);
+	}
+
+	//	Apply what b's thread has recorded, and add its counts to the
+	//	totals. Requires the heap lock and b's mutex.
+	//
+	inline
+	void deferred_heap::merge(thread_buffer& b) {
+		for (auto& r : b.registrations) {
+			if (r.add) {
+				add_registration(*r.p, r.value);
+			}
+			else {
+				remove_registration(*r.p, r.value);
+			}
+		}
+		b.registrations.clear();
+
+		if (phase == collect_phase::marking) {
+			for (auto p : b.shades) {
+				shade_now_or_later(p);
+			}
+		}
+		b.shades.clear();
+
+		pending_destructors += b.dtors.size();
+		b.dtors.move_all([this](const byte* p) -> destructors& { return find_dhpage_of(p)->dtors; });
+
+		total_allocations += b.allocations;
+		total_bytes_allocated += b.bytes_allocated;
+		bytes_since_collect += b.bytes_allocated;
+		bytes_used += b.bytes_used;
+		bytes_in_nonempty_pages += b.bytes_in_nonempty_pages;
+		live_allocations += b.live_allocations;
+		b.allocations = b.bytes_allocated = b.bytes_used = 0;
+		b.bytes_in_nonempty_pages = b.live_allocations = 0;
+	}
+
+	//	Merge every thread's buffer. When the world is stopped, also take
+	//	the threads' pages away and apply the shades that were waiting, so
+	//	that the heap is just as it would be without buffers.
+	//
+	inline
+	void deferred_heap::merge_thread_buffers() {
+		auto l = lock();
+		for (auto& b : thread_buffers) {
+			std::lock_guard<std::mutex> hold{ b.mutex };
+			merge(b);
+			if (world_stopped && b.page != nullptr) {
+				b.page->owner = nullptr;
+				b.page = nullptr;
+			}
+		}
+
+		if (world_stopped) {
+			if (phase == collect_phase::marking) {
+				for (auto p : pending_shades) {
+					mark(p);
+				}
+			}
+			pending_shades.clear();
+		}
+	}
+
+	//	Wait at a safepoint while a collection is pending. Requires l to be
+	//	holding safepoint_mutex.
+	//
+	inline
+	void deferred_heap::park(std::unique_lock<std::mutex>& l) {
+		if (!stop_requested) {
+			return;
+		}
+		auto attached = is_attached_thread();
+		if (attached) {
+			++parked_threads;
+			safepoint_cv.notify_all();
+		}
+		safepoint_cv.wait(l, [this] { return !stop_requested; });
+		if (attached) {
+			--parked_threads;
+		}
+	}
+
+	//	Request that all attached threads stop at their next safepoint, and
+	//	wait until they have. Returns false if another thread was already
+	//	collecting, in which case we have waited for it to finish instead.
+	//
+	inline
+	bool deferred_heap::stop_the_world() {
+		std::unique_lock<std::mutex> l{ safepoint_mutex };
+		if (stop_requested) {
+			park(l);
+			return false;
+		}
+		stop_requested = true;
+		std::size_t self = is_attached_thread() ? 1 : 0;
+		safepoint_cv.wait(l, [this, self] { return parked_threads + self >= attached_threads; });
+		world_stopped = true;
+		l.unlock();
+
+		merge_thread_buffers();
+		return true;
+	}
+
+	inline
+	void deferred_heap::resume_the_world() {
+		{
+			std::lock_guard<std::mutex> l{ safepoint_mutex };
+			world_stopped = false;
+			stop_requested = false;
+		}
+		safepoint_cv.notify_all();
+	}
+
+	inline
+	void deferred_heap::set_background_collection(bool enable, std::size_t budget) {
+		GCPP_EXPECTS((!enable || thread_safe)
+			&& "background collection requires a thread-safe heap");
+		GCPP_EXPECTS(budget > 0 && "a step must be able to make progress");
+		stop_background_collector();
+		if (enable) {
+			background_budget = budget;
+			background_requested = background_stopping = background_finished = false;
+			background_thread = std::thread{ [this] { run_background_collector(); } };
+		}
+	}
+
+	inline
+	void deferred_heap::collect_in_background() {
+		{
+			std::lock_guard<std::mutex> l{ safepoint_mutex };
+			background_requested = true;
+		}
+		background_cv.notify_one();
+	}
+
+	//	The background collector's thread, which isn't attached: it stops
+	//	the world for each step like any other collecting thread
+	//
+	inline
+	void deferred_heap::run_background_collector() {
+		std::unique_lock<std::mutex> l{ safepoint_mutex };
+		for (;;) {
+			background_cv.wait(l, [this] { return background_requested || background_stopping; });
+			if (background_stopping) {
+				break;
+			}
+			background_requested = false;
+			l.unlock();
+
+			//	step until this collection is done, by us or by another thread
+			auto before = stats().collections;
+			while (!collect_step(background_budget) && stats().collections == before) {
+				std::this_thread::yield();
+				std::lock_guard<std::mutex> g{ safepoint_mutex };
+				if (background_stopping) {
+					break;
+				}
+			}
+			l.lock();
+		}
+		background_finished = true;
+		safepoint_cv.notify_all();
+	}
+
+	//	Stop the background collector, if there is one, and wait for it. An
+	//	unfinished collection is left for the next collect() or collect_step().
+	//	While we wait, the collector may need to stop the world, so count as
+	//	parked (we don't touch any deferred_ptr meanwhile).
+	//
+	inline
+	void deferred_heap::stop_background_collector() {
+		if (!background_thread.joinable()) {
+			return;
+		}
+		{
+			std::unique_lock<std::mutex> l{ safepoint_mutex };
+			background_stopping = true;
+			background_cv.notify_one();
+			auto attached = is_attached_thread();
+			if (attached) {
+				++parked_threads;
+				safepoint_cv.notify_all();
+			}
+			safepoint_cv.wait(l, [this] { return background_finished; });
+			if (attached) {
+				--parked_threads;
+			}
+		}
+		background_thread.join();
+	}
+
+	inline
+	heap_stats deferred_heap::stats() const
+	{
+		auto l = lock();
+
+		//	(this changes only where things are recorded, not what the heap holds)
+		if (!thread_buffers.empty()) {
+			const_cast<deferred_heap*>(this)->merge_thread_buffers();
+		}
+
+		heap_stats ret;
+		ret.pages = pages.size();
+		ret.bytes_reserved = heap_bytes;
+		ret.bytes_used = bytes_used;
+		ret.bytes_fragmented = bytes_in_nonempty_pages - bytes_used;
+		ret.live_allocations = live_allocations;
+		ret.interior_pointers = interior_pointers;
+		ret.pending_destructors = pending_destructors;
+		ret.roots = roots.size();
+		ret.weak_pointers = weak_ptrs.size();
+
+		ret.total_allocations = total_allocations;
+		ret.total_bytes_allocated = total_bytes_allocated;
+		ret.collections = collections;
+		ret.minor_collections = minor_collections;
+		ret.bytes_freed = bytes_freed;
+		ret.last_pause = last_pause;
+		ret.total_pause = total_pause;
+		return ret;
+	}
+
+	inline
+	void deferred_heap::count_change(const dhpage& pg, page_usage before, std::size_t& used,
+		std::size_t& in_nonempty_pages, std::size_t& allocations) noexcept
+	{
+		auto after = usage_of(pg);
+		used += after.bytes - before.bytes;	// unsigned, so this also subtracts
+		allocations += after.allocations - before.allocations;
+		if (before.allocations == 0 && after.allocations > 0) {
+			in_nonempty_pages += pg.page.size();
+		}
+		else if (before.allocations > 0 && after.allocations == 0) {
+			in_nonempty_pages -= pg.page.size();
+		}
+	}
+
+	//	Total up the surviving samples by site
+	//
+	inline
+	void deferred_heap::update_profile()
+	{
+		profile.clear();
+		std::map<std::pair<const void*, const char*>, std::size_t> index;	// into profile
+		for (auto& s : samples) {
+			auto i = index.emplace(std::make_pair(s.second.site, s.second.type), profile.size());
+			if (i.second) {
+				profile.push_back({ s.second.type, s.second.site, 0, 0 });
+			}
+			++profile[i.first->second].samples;
+			profile[i.first->second].bytes += s.second.bytes;
+		}
+		std::sort(profile.begin(), profile.end(), 
+			[](auto& a, auto& b) { return a.bytes > b.bytes; });
+	}
+
+	//	Account for the time spent in a collection phase that began at
+	//	'start', and report it to the observer
+	//
+	inline
+	void deferred_heap::end_phase(const char* name, std::chrono::nanoseconds collect_pause::* time,
+		clock::time_point start, std::size_t visited, std::size_t edges)
+	{
+		auto duration = since(start);
+		this_pause.*time += duration;
+		if (observer) {
+			observer({ name, collections + 1, minor_in_progress, start, duration, visited, edges });
+		}
+	}
+
+	inline
+	deferred_heap::allocation_bounds deferred_heap::find_allocation(const void* p) const noexcept
+	{
+		auto l = lock();
+		auto pg = find_dhpage_of(p);
+		if (pg == nullptr) {
+			GCPP_EXPECTS(!"corrupt non-null deferred_ptr, not pointing into deferred heap");
+			return{ nullptr, nullptr };
+		}
+
+		//	another thread may be allocating in the page
+		std::unique_lock<std::mutex> owner_lock;
+		if (pg->owner != nullptr) {
+			owner_lock = std::unique_lock<std::mutex>{ pg->owner->mutex };
+		}
+		auto info = pg->page.contains_info((const byte*)p);
+		GCPP_EXPECTS(info.found > gpage::in_range_unallocated
+			&& "corrupt non-null deferred_ptr, pointing to unallocated memory");
+		return{ pg->page.location_info(gsl::narrow_cast<int>(info.start_location)).pointer,
+				pg->page.allocation_end(info.start_location) };
+	}
+
+	//	Decide whether to collect before adding a page of page_bytes
+	//
+	inline
+	bool deferred_heap::should_collect_before_expand(std::size_t page_bytes) const
+	{
+		if (policy.collect_before_expand) {
+			return true;
+		}
+		if (policy.max_heap_bytes > 0 
+			&& heap_bytes + page_bytes > policy.max_heap_bytes) {
+			return true;
+		}
+		//	don't let the growth trigger fire while the heap is still small
+		if (policy.growth_factor > 0
+			&& heap_bytes + page_bytes > policy.growth_factor 
+				* std::max<std::size_t>(live_bytes_after_collect, page_bytes)) {
+			return true;
+		}
+		if (policy.trigger) {
+			return policy.trigger({ bytes_since_collect, live_bytes_after_collect,
+									heap_bytes, page_bytes });
+		}
+		return false;
+	}
+
+	//	Free every page that collect() has now found empty more than
+	//	'retention' times in a row, and discard the memory behind the empty
+	//	pages we keep for now. No user code runs here, and an empty page
+	//	cannot contain a deferred_ptr or be pointed to by one (any pointer
+	//	into a deallocated allocation was nulled in collect()).
+	//
+	inline
+	void deferred_heap::release_empty_pages(std::size_t retention) noexcept
+	{
+		for (auto it = pages.begin(); it != pages.end(); /*--*/) {
+			if (it->owner != nullptr || !it->page.is_empty()) {
+				it->empty_collections = 0;
+				++it;
+				continue;
+			}
+
+			GCPP_EXPECTS(it->deferred_ptrs.empty()
+				&& "an empty page cannot contain deferred_ptrs");
+			if (++it->empty_collections > retention) {
+				heap_bytes -= it->page.size();
+				auto& local = pages_by_node[it->node];
+				local.erase(std::find(local.begin(), local.end(), &*it));
+				pages_by_address.erase((const byte*)it->page.begin());
+				it = pages.erase(it);
+			}
+			else {
+				//	keep the page, but not the physical memory behind it
+				if (it->empty_collections == 1) {
+					it->page.discard();
+				}
+				++it;
+			}
+		}
+	}
+
+	//	Return the pages, those on the calling thread's NUMA node first
+	//
+	inline
+	std::vector<deferred_heap::dhpage*> deferred_heap::pages_local_first()
+	{
+		std::vector<dhpage*> ret;
+		ret.reserve(pages.size());
+		if (!numa_aware) {
+			for (auto& pg : pages) {
+				ret.push_back(&pg);
+			}
+			return ret;
+		}
+
+		auto local = (std::size_t)current_numa_node();
+		if (local < pages_by_node.size()) {
+			ret = pages_by_node[local];
+		}
+		for (std::size_t node = 0; node < pages_by_node.size(); ++node) {
+			if (node != local) {
+				ret.insert(ret.end(), pages_by_node[node].begin(), pages_by_node[node].end());
+			}
+		}
+		return ret;
+	}
+
+	inline
+	void destructors::debug_print() const {
+		std::cout << "\n  destructors size() is " << size() << " in " << dtors.size() << " records\n";
+		for (auto& d : dtors) {
+			std::cout << "    " << (void*)(d.p) << " x " << d.count << ", " << (void*)(d.destroy) << "\n";
+		}
+		std::cout << "\n";
+	}
+
+	inline
+	const char* deferred_heap::verify()
+	{
+		if (thread_safe && !stop_the_world()) {
+			return verify();	// another thread was collecting, so look again
+		}
+		auto l = lock();
+		auto ret = verify_stopped();
+
+		if (thread_safe) {
+			l.unlock();
+			resume_the_world();
+		}
+		return ret;
+	}
+
+	inline
+	const char* deferred_heap::verify_stopped() const
+	{
+		//	every thread's buffer has been merged, so each deregistration
+		//	has met its registration
+		if (!stray_removals.empty()) {
+			return "a deferred_ptr was deregistered but never registered";
+		}
+
+		std::vector<const dhpage*> all;
+		for (auto& pg : pages) {
+			all.push_back(&pg);
+		}
+
+		//	Return the start location of the allocation p points into in pg,
+		//	or -1 if it doesn't point into one
+		auto allocation_in = [](const dhpage& pg, const void* p) -> std::ptrdiff_t {
+			auto where = pg.page.contains_info((const byte*)p);
+			if (where.found == gpage::in_range_allocated_start
+				|| where.found == gpage::in_range_allocated_middle) {
+				return where.start_location;
+			}
+			return -1;
+		};
+
+		auto check_target = [&](const deferred_ptr_void* dp) -> const char* {
+			if (dp->myheap != this) {
+				return "a deferred_ptr tracked by this heap is attached to another";
+			}
+			if (dp->p == nullptr) {
+				return nullptr;
+			}
+			auto pg = find_dhpage_of(dp->p);
+			if (pg == nullptr) {
+				return "a deferred_ptr points outside the heap";
+			}
+			return allocation_in(*pg, dp->p) >= 0 ? nullptr
+				: "a deferred_ptr points to unallocated memory";
+		};
+
+		//	Check the pages in [first, all.size()) in steps of 'stride'
+		auto check_pages = [&](std::size_t first, std::size_t stride) -> const char* {
+			for (auto i = first; i < all.size(); i += stride) {
+				auto& pg = *all[i];
+				if (auto what = pg.page.verify()) {
+					return what;
+				}
+				for (auto& dp : pg.deferred_ptrs) {
+					if (!pg.page.contains((const byte*)dp.p) || allocation_in(pg, dp.p) < 0) {
+						return "an interior deferred_ptr is not inside an allocation in its page";
+					}
+					if (auto what = check_target(dp.p)) {
+						return what;
+					}
+				}
+				const char* what = nullptr;
+				std::size_t objects = 0;
+				const byte* prev_end = nullptr;
+				pg.dtors.for_each_range([&](const byte* begin, const byte* end, std::size_t count) {
+					objects += count;
+					auto start = allocation_in(pg, begin);
+					if (what == nullptr && (start < 0 || allocation_in(pg, end - 1) != start)) {
+						what = "a destructor record is not within one allocation in its page";
+					}
+					if (what == nullptr && begin < prev_end) {
+						what = "a page's destructor records are out of order";
+					}
+					prev_end = end;
+				});
+				if (what != nullptr) {
+					return what;
+				}
+				if (objects != pg.dtors.size()) {
+					return "a page's count of pending destructors is wrong";
+				}
+			}
+			return nullptr;
+		};
+
+		//	Check the pages in parallel, one share on this thread ...
+		auto tasks = std::min<std::size_t>(all.size(),
+			std::max(1u, std::thread::hardware_concurrency()));
+		std::vector<std::future<const char*>> others;
+		for (std::size_t t = 1; t < tasks; ++t) {
+			others.push_back(std::async(std::launch::async | std::launch::deferred,
+				check_pages, t, tasks));
+		}
+		auto mine = check_pages(0, std::max<std::size_t>(tasks, 1));
+
+		//	... while it also checks the roots
+		const char* what = nullptr;
+		for (auto& p : roots) {
+			what = find_dhpage_of(p) != nullptr ? "a root is inside the heap"
+				: check_target(p);
+			if (what != nullptr) {
+				break;
+			}
+		}
+
+		if (what == nullptr) {
+			what = mine;
+		}
+		for (auto& f : others) {
+			auto r = f.get();
+			if (what == nullptr) {
+				what = r;
+			}
+		}
+
+		//	the running totals that stats() reports must match the pages
+		heap_stats actual;
+		for (auto& pg : pages) {
+			actual.bytes_reserved += pg.page.size();
+			actual.bytes_used += pg.page.bytes_in_use();
+			if (!pg.page.is_empty()) {
+				actual.bytes_fragmented += pg.page.size() - pg.page.bytes_in_use();
+			}
+			actual.live_allocations += pg.page.allocations();
+			actual.interior_pointers += pg.deferred_ptrs.size();
+			actual.pending_destructors += pg.dtors.size();
+		}
+		if (what == nullptr
+			&& (actual.bytes_reserved != heap_bytes
+				|| actual.bytes_used != bytes_used
+				|| actual.bytes_fragmented != bytes_in_nonempty_pages - bytes_used
+				|| actual.live_allocations != live_allocations
+				|| actual.interior_pointers != interior_pointers
+				|| actual.pending_destructors != pending_destructors)) {
+			what = "the heap's running totals don't match its pages";
+		}
+		return what;
+	}
+
+	//	With GCPP_VERIFY_HEAP defined, check the heap and stop if it is
+	//	inconsistent; otherwise do nothing
+	//
+	inline
+	void deferred_heap::verify_or_fail(const char* when) const
+	{
+#ifdef GCPP_VERIFY_HEAP
+		if (auto what = verify_stopped()) {
+			std::cerr << "deferred_heap [" << (void*)this << "] failed verification "
+				<< when << ": " << what << "\n";
+			Expects(!"heap verification failed");
+		}
+#else
+		(void)when;
+#endif
 	}
 
 	inline
 	void deferred_heap::debug_print() const 
 	{
+		auto l = lock();
 		std::cout << "\n*** heap snapshot [" << (void*)this << "] ************************************************\n\n";
 		for (auto& pg : pages) {
 			pg.page.debug_print();
 			std::cout << "\n  this page's deferred_ptrs.size() is " << pg.deferred_ptrs.size() << "\n";
 			for (auto& dp : pg.deferred_ptrs) {
-				std::cout << "    " << (void*)dp.p << " -> " << dp.p->get()
-					<< ", level " << dp.level << "\n";
+				std::cout << "    " << (void*)dp.p << " -> " << dp.p->get() << "\n";
 			}
-			std::cout << "\n";
+			pg.dtors.debug_print();
 		}
 		std::cout << "  roots.size() is " << roots.size() 
 				  << ", load_factor is " << roots.load_factor() << "\n";
 		for (auto& p : roots) {
 			std::cout << "    " << (void*)p << " -> " << p->get() << "\n";
 		}
-		dtors.debug_print();
 	}
 
 }
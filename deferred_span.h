@@ -0,0 +1,123 @@
+
+/////////////////////////////////////////////////////////////////////////////// 
+// 
+// Copyright (c) 2016 Herb Sutter. All rights reserved. 
+// 
+// This code is licensed under the MIT License (MIT). 
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+// THE SOFTWARE. 
+// 
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef GCPP_DEFERRED_SPAN
+#define GCPP_DEFERRED_SPAN
+
+#include "deferred_allocator.h"
+
+#include <type_traits>
+
+namespace gcpp {
+
+	//----------------------------------------------------------------------------
+	//
+	//	deferred_span - A view of contiguous objects in a deferred_heap, whose
+	//	iterators are raw pointers. Iterating, or running algorithms such as
+	//	std::sort and std::find, over a deferred_span doesn't register and
+	//	deregister a deferred_ptr for each iterator the way iterating
+	//	deferred_vector's own iterators does.
+	//
+	//	The span keeps its objects alive in one of two ways:
+	//
+	//	- a span of a deferred_ptr's allocation holds one copy of that
+	//	  deferred_ptr, however many iterators are made from it
+	//
+	//	- a span of a container, such as a deferred_vector, relies on the
+	//	  container to keep its buffer alive, and like a std::span of a
+	//	  std::vector is invalidated when the container reallocates
+	//
+	//	To store an iterator, convert it back into a deferred_ptr with
+	//	to_deferred(). As for any raw pointer, compact() invalidates the span.
+	//
+	//----------------------------------------------------------------------------
+
+	template<class T>
+	class deferred_span {
+		deferred_heap*	heap = nullptr;
+		deferred_ptr<T>	pin;	// keeps the objects alive, if the container doesn't
+		T*				first = nullptr;
+		T*				last = nullptr;
+
+	public:
+		using element_type	= T;
+		using value_type	= std::remove_cv_t<T>;
+		using iterator		= T*;
+		using size_type		= std::size_t;
+
+		deferred_span() = default;
+
+		//	The n objects starting at p
+		//
+		deferred_span(const deferred_ptr<T>& p, size_type n)
+			: heap{ p.get_heap() }
+			, pin{ p }
+			, first{ p.get() }
+			, last{ p.get() + n }
+		{
+			GCPP_EXPECTS((p != nullptr || n == 0) && "cannot span objects at null");
+#ifndef NDEBUG
+			if (n > 0) {
+				(void)(p + gsl::narrow_cast<int>(n));	// check that they're in one allocation
+			}
+#endif
+		}
+
+		//	The elements of a contiguous container that uses deferred_allocator
+		//
+		template<class Container, class = decltype(std::declval<Container&>().data())>
+		explicit deferred_span(Container& c)
+			: heap{ &c.get_allocator().heap() }
+			, first{ c.data() }
+			, last{ c.data() + c.size() }
+		{ }
+
+		iterator  begin() const noexcept { return first; }
+		iterator  end()   const noexcept { return last; }
+		T*        data()  const noexcept { return first; }
+		size_type size()  const noexcept { return last - first; }
+		bool      empty() const noexcept { return first == last; }
+
+		T& operator[](size_type i) const noexcept {
+			GCPP_EXPECTS(i < size() && "deferred_span index out of range");
+			return first[i];
+		}
+
+		deferred_span subspan(size_type offset, size_type count) const noexcept {
+			GCPP_EXPECTS(offset + count <= size() && "deferred_span::subspan out of range");
+			auto ret = *this;
+			ret.first = first + offset;
+			ret.last = ret.first + count;
+			return ret;
+		}
+
+		//	Return a deferred_ptr to the element at 'it' (which may be end()),
+		//	that keeps it alive on its own
+		//
+		deferred_ptr<T> to_deferred(iterator it) const {
+			GCPP_EXPECTS(first <= it && it <= last && "iterator is not in this deferred_span");
+			if (it == nullptr) {
+				return{};
+			}
+			return{ heap, it };
+		}
+	};
+
+}
+
+#endif
@@ -0,0 +1,148 @@
+
+/////////////////////////////////////////////////////////////////////////////// 
+// 
+// Copyright (c) 2016 Herb Sutter. All rights reserved. 
+// 
+// This code is licensed under the MIT License (MIT). 
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+// THE SOFTWARE. 
+// 
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef GCPP_DEFERRED_WEAK_MAP
+#define GCPP_DEFERRED_WEAK_MAP
+
+#include "deferred_heap.h"
+
+#include <list>
+#include <unordered_map>
+
+namespace gcpp {
+
+	//----------------------------------------------------------------------------
+	//
+	//	deferred_weak_map - A map from objects in a deferred_heap, by identity,
+	//	to values in the same heap, where each value is kept alive only while
+	//	its key is reachable from somewhere other than this map (and the map
+	//	doesn't keep its keys alive at all). Each entry is a deferred_ephemeron,
+	//	so an entry whose value refers back to its own key can still be
+	//	collected, which is what makes this suitable for memoization tables.
+	//
+	//	Collection nulls the entries whose keys died; the map drops them, and
+	//	rebuilds its index (compaction may have moved the keys), lazily on the
+	//	first use after each collection or compaction.
+	//
+	//	Like the std:: containers, a deferred_weak_map is not thread-safe.
+	//
+	//----------------------------------------------------------------------------
+
+	template<class K, class V>
+	class deferred_weak_map {
+		using entry = deferred_ephemeron<K, V>;
+
+		deferred_heap&	h;
+		std::list<entry> entries;	// a list, because entries can't move
+		std::unordered_map<const K*, typename std::list<entry>::iterator> index;
+		std::size_t		seen_epoch;
+
+		void refresh() {
+			if (seen_epoch == h.epoch()) {
+				return;
+			}
+			seen_epoch = h.epoch();
+			index.clear();
+			for (auto it = entries.begin(); it != entries.end(); /*--*/) {
+				if (it->expired()) {
+					it = entries.erase(it);
+				}
+				else {
+					index.emplace(it->key_address(), it);
+					++it;
+				}
+			}
+		}
+
+		//	Find key's entry, dropping it instead if it has expired without a
+		//	collection (e.g., by deferred_heap::reset)
+		//
+		auto lookup(const deferred_ptr<K>& key) {
+			refresh();
+			auto i = index.find(key.get());
+			if (i != index.end() && i->second->expired()) {
+				entries.erase(i->second);
+				index.erase(i);
+				return index.end();
+			}
+			return i;
+		}
+
+	public:
+		deferred_weak_map(deferred_heap& h_)
+			: h{ h_ }
+			, seen_epoch{ h_.epoch() }
+		{ }
+
+		deferred_heap& heap() const noexcept { return h; }
+
+		//	Map key to value, replacing any value key already had.
+		//
+		void insert_or_assign(const deferred_ptr<K>& key, const deferred_ptr<V>& value) {
+			GCPP_EXPECTS(key != nullptr && "a deferred_weak_map key cannot be null");
+			auto i = lookup(key);
+			if (i != index.end()) {
+				i->second->set(key, value);
+				return;
+			}
+			entries.emplace_back(h);
+			entries.back().set(key, value);
+			index.emplace(key.get(), std::prev(entries.end()));
+		}
+
+		//	Return the value for key, or null if there is none.
+		//
+		deferred_ptr<V> find(const deferred_ptr<K>& key) {
+			auto i = lookup(key);
+			return i == index.end() ? deferred_ptr<V>{} : i->second->value();
+		}
+
+		bool contains(const deferred_ptr<K>& key) {
+			return lookup(key) != index.end();
+		}
+
+		//	Remove key's entry, returning whether there was one.
+		//
+		bool erase(const deferred_ptr<K>& key) {
+			auto i = lookup(key);
+			if (i == index.end()) {
+				return false;
+			}
+			entries.erase(i->second);
+			index.erase(i);
+			return true;
+		}
+
+		std::size_t size() {
+			refresh();
+			return entries.size();
+		}
+
+		bool empty() {
+			return size() == 0;
+		}
+
+		void clear() {
+			index.clear();
+			entries.clear();
+		}
+	};
+
+}
+
+#endif
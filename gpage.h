@@ -24,6 +24,26 @@
 #include <vector>
 #include <algorithm>
 #include <memory>
+#include <new>
+#include <cstdint>
+
+#if defined(_WIN32)
+//	keep windows.h from defining min and max macros, which would break the
+//	std::numeric_limits<T>::max() calls here and in deferred_heap.h
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 //#ifndef NDEBUG
 #include <iostream>
@@ -32,6 +52,66 @@
 
 namespace gcpp {
 
+	//----------------------------------------------------------------------------
+	//
+	//	gpage_storage - Where a gpage gets its storage bytes from
+	//
+	//  heap		operator new[]; the bytes are not zero-filled
+	//  mapped		reserved directly from the OS (mmap/VirtualAlloc), so the
+	//				bytes are committed lazily on first touch and big pages
+	//				bypass the general-purpose allocator
+	//  huge		as mapped, but backed by huge pages where the OS allows it
+	//				(MAP_HUGETLB, else transparent huge pages via MADV_HUGEPAGE)
+	//
+	//----------------------------------------------------------------------------
+
+	enum class gpage_storage {
+		heap,
+		mapped,
+		huge
+	};
+
+	namespace detail {
+
+		//	Every page's storage starts on at least a cache line boundary, so
+		//	that common over-aligned types start at location 0 (mapped storage
+		//	is aligned to the OS page size)
+		//
+		const std::size_t gpage_storage_alignment = 64;
+
+		//	Greatest common divisor (std::gcd is C++17)
+		//
+		constexpr std::size_t gcd(std::size_t a, std::size_t b) noexcept {
+			while (b != 0) {
+				auto r = a % b;
+				a = b;
+				b = r;
+			}
+			return a;
+		}
+
+		//	Releases gpage storage the same way it was obtained
+		//
+		struct gpage_storage_deleter {
+			gpage_storage	kind   = gpage_storage::heap;
+			std::size_t		length = 0;		// bytes actually reserved
+			std::size_t		offset = 0;		// heap: bytes skipped to align the start
+
+			void operator()(byte* p) const noexcept;
+		};
+
+		using gpage_storage_ptr = std::unique_ptr<byte[], gpage_storage_deleter>;
+
+		gpage_storage_ptr allocate_gpage_storage(std::size_t size, gpage_storage kind, int numa_node = -1);
+
+	}
+
+	//	Return the NUMA node of the processor the calling thread is running on,
+	//	or 0 if that can't be determined. The answer is cached per thread and
+	//	refreshed every so often, since threads rarely migrate between nodes.
+	//
+	int current_numa_node() noexcept;
+
 	//----------------------------------------------------------------------------
 	//
 	//	gpage - One contiguous allocation
@@ -39,11 +119,13 @@ namespace gcpp {
 	//  total_size	Total page size (page does not grow)
 	//  min_alloc	Minimum allocation size in bytes
 	//
-	//	storage		Underlying storage bytes
+	//	storage		Underlying storage bytes (see gpage_storage)
 	//  inuse		Tracks whether location is in use: false = unused, true = used
 	//  starts		Tracks whether location starts an allocation: false = no, true = yes
 	//
 	//	current_known_request_bound		Cached hint about largest current hole
+	//	current_allocations				Number of live allocations in this page
+	//	current_locations_in_use		Number of locations those allocations cover
 	//
 	//----------------------------------------------------------------------------
 
@@ -51,10 +133,12 @@ namespace gcpp {
 	private:
 		const std::size_t				total_size;
 		const std::size_t				min_alloc;
-		const std::unique_ptr<byte[]>	storage;
+		const detail::gpage_storage_ptr	storage;
 		bitflags						inuse;
 		bitflags						starts;
 		std::size_t						current_known_request_bound = total_size;
+		std::size_t						current_allocations = 0;
+		std::size_t						current_locations_in_use = 0;
 
 		//	Copy and move are disabled by const unique_ptr member, but let's be explicit
 		//
@@ -64,11 +148,34 @@ namespace gcpp {
 	public:
 		int locations() const noexcept { return gsl::narrow_cast<int>(total_size) / min_alloc; }
 
+		std::size_t size() const noexcept { return total_size; }
+
 		const void* begin() const { return storage.get(); }
 
+		//	Return whether there are no allocations in this page.
+		//
+		bool is_empty() const noexcept { return current_allocations == 0; }
+
+		//	Return the number of live allocations in this page.
+		//
+		std::size_t allocations() const noexcept { return current_allocations; }
+
+		//	Return the number of locations currently allocated.
+		//
+		int locations_in_use() const noexcept { return gsl::narrow_cast<int>(current_locations_in_use); }
+
+		//	Return the number of bytes currently allocated (in whole locations).
+		//
+		std::size_t bytes_in_use() const noexcept { return current_locations_in_use * min_alloc; }
+
 		//	Construct a page with a given size and chunk size
 		//
-		gpage(std::size_t total_size_ = 1024, std::size_t min_alloc_ = 4);
+		//	If numa_node >= 0, mapped storage is bound to (preferably allocated
+		//	on) that node; heap storage instead lands wherever it is first
+		//	touched, which is normally on the allocating thread's node.
+		//
+		gpage(std::size_t total_size_ = 1024, std::size_t min_alloc_ = 4,
+			  gpage_storage storage_ = gpage_storage::heap, int numa_node = -1);
 
 		//  Allocate space for n objects of type T
 		//
@@ -102,11 +209,33 @@ namespace gcpp {
 		location_info_ret
 		location_info(int where) const noexcept;
 
+		//  Return the end of the allocation that starts at this location.
+		//
+		byte* allocation_end(std::size_t start) const noexcept;
+
 		//  Deallocate the allocation that starts at *p.
 		//	Note: p must be a pointer previously returned by allocate().
 		//
 		void deallocate(gsl::not_null<byte*> p) noexcept;
 
+		//	Deallocate everything in this page at once, without running any
+		//	destructors, by clearing the tracking bitmaps.
+		//
+		void clear() noexcept;
+
+		//	Give the physical memory behind an empty page back to the OS while
+		//	keeping the page itself; it is committed again on next touch.
+		//	A no-op for heap storage.
+		//
+		void discard() noexcept;
+
+		//	Check that the tracking information is consistent: every start is
+		//	in use, every in-use location belongs to an allocation that starts
+		//	at or before it, and the counters match the bitmaps. Returns null
+		//	if so, else a description of the first problem found.
+		//
+		const char* verify() const noexcept;
+
 		//	Debugging support
 		//
 		void debug_print() const;
@@ -120,21 +249,148 @@ namespace gcpp {
 	//----------------------------------------------------------------------------
 	//
 
+	namespace detail {
+
+		inline
+		void gpage_storage_deleter::operator()(byte* p) const noexcept {
+			if (kind == gpage_storage::heap) {
+				delete[] (p - offset);
+				return;
+			}
+#if defined(_WIN32)
+			VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(__unix__) || defined(__APPLE__)
+			munmap(p, length);
+#endif
+		}
+
+		//	Ask the OS to place the (not yet touched) pages of [p, p+length) on
+		//	the given node. Preferred rather than strict, so that allocation
+		//	falls back to other nodes instead of failing when the node is full.
+		//	Just a hint: ignore failure, e.g. on a kernel without NUMA support.
+		//
+		inline
+		void bind_to_numa_node(void* p, std::size_t length, int node) noexcept {
+#if defined(__linux__) && defined(SYS_mbind)
+			const int mpol_preferred = 1;	// MPOL_PREFERRED, from <numaif.h>
+			const auto bits = 8 * sizeof(unsigned long);
+			std::vector<unsigned long> mask(node / bits + 1, 0);
+			mask[node / bits] = 1UL << (node % bits);
+			syscall(SYS_mbind, p, length, mpol_preferred, mask.data(), mask.size() * bits + 1, 0);
+#else
+			(void)p; (void)length; (void)node;
+#endif
+		}
+
+		inline
+		gpage_storage_ptr allocate_gpage_storage(std::size_t size, gpage_storage kind, int numa_node) {
+#if defined(_WIN32)
+			if (kind != gpage_storage::heap) {
+				//	committed pages are not backed by physical memory until touched
+				auto p = numa_node >= 0
+					? VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT,
+										 PAGE_READWRITE, (DWORD)numa_node)
+					: VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+				if (p == nullptr) {
+					throw std::bad_alloc();
+				}
+				return{ static_cast<byte*>(p), { kind, size } };
+			}
+#elif defined(__unix__) || defined(__APPLE__)
+			if (kind != gpage_storage::heap) {
+				const int flags = MAP_PRIVATE | MAP_ANONYMOUS
+#ifdef MAP_NORESERVE
+					| MAP_NORESERVE
+#endif
+					;
+				void* p = MAP_FAILED;
+				auto length = size;
+
+#ifdef MAP_HUGETLB
+				//	explicit huge pages need a length that is a multiple of the
+				//	huge page size, and fail if none are reserved on the system
+				const std::size_t huge_page_size = 2 * 1024 * 1024;
+				if (kind == gpage_storage::huge && size >= huge_page_size) {
+					auto huge_length = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+					p = mmap(nullptr, huge_length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+					if (p != MAP_FAILED) {
+						length = huge_length;
+					}
+				}
+#endif
+
+				if (p == MAP_FAILED) {
+					p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+					if (p == MAP_FAILED) {
+						throw std::bad_alloc();
+					}
+#ifdef MADV_HUGEPAGE
+					if (kind == gpage_storage::huge) {
+						madvise(p, size, MADV_HUGEPAGE);	// just a hint, ignore failure
+					}
+#endif
+				}
+
+				if (numa_node >= 0) {
+					bind_to_numa_node(p, length, numa_node);
+				}
+
+				return{ static_cast<byte*>(p), { kind, length } };
+			}
+#endif
+			(void)numa_node;	// heap storage is placed by first touch
+
+			//	note: not make_unique, which would zero-fill (and touch) every byte;
+			//	over-allocate, and start at the first suitably aligned byte
+			auto p = new byte[size + gpage_storage_alignment - 1];
+			auto offset = (gpage_storage_alignment
+				- reinterpret_cast<std::uintptr_t>(p) % gpage_storage_alignment) % gpage_storage_alignment;
+			return{ p + offset, { gpage_storage::heap, size, offset } };
+		}
+
+	}
+
+
+	inline
+	int current_numa_node() noexcept {
+		thread_local int node = 0;
+		thread_local int calls_until_refresh = 0;
+		if (calls_until_refresh-- > 0) {
+			return node;
+		}
+		calls_until_refresh = 4096;
+#if defined(_WIN32)
+		PROCESSOR_NUMBER processor;
+		USHORT n = 0;
+		GetCurrentProcessorNumberEx(&processor);
+		if (GetNumaProcessorNodeEx(&processor, &n)) {
+			node = n;
+		}
+#elif defined(__linux__) && defined(SYS_getcpu)
+		unsigned cpu = 0, n = 0;
+		if (syscall(SYS_getcpu, &cpu, &n, nullptr) == 0) {
+			node = (int)n;
+		}
+#endif
+		return node;
+	}
+
+
 	//	Construct a page with a given size and chunk size
 	//
 	inline 
-	gpage::gpage(std::size_t total_size_, std::size_t min_alloc_)
+	gpage::gpage(std::size_t total_size_, std::size_t min_alloc_, gpage_storage storage_, int numa_node)
 		//	total_size must be a multiple of min_alloc, so round up if necessary
 		: total_size(total_size_ +
 			(total_size_ % min_alloc_ > 0
 			? min_alloc_ - (total_size_ % min_alloc_)
 			: 0))
 		, min_alloc(min_alloc_)
-		, storage(std::make_unique<byte[]>(total_size))
-		, inuse(total_size, false)
-		, starts(total_size, false)
+		, storage(detail::allocate_gpage_storage(total_size, storage_, numa_node))
+		, inuse(locations(), false)
+		, starts(locations(), false)
 	{
-		Expects(total_size % min_alloc == 0 &&
+		GCPP_EXPECTS(total_size % min_alloc == 0 &&
 			"total_size must be a multiple of min_alloc");
 	}
 
@@ -143,7 +399,7 @@ namespace gcpp {
 	//
 	template<class T>
 	byte* gpage::allocate(int n) noexcept {
-		Expects(n > 0 && "cannot request an empty allocation");
+		GCPP_EXPECTS(n > 0 && "cannot request an empty allocation");
 
 		const auto bytes_needed = sizeof(T)*n;
 
@@ -152,38 +408,42 @@ namespace gcpp {
 			return nullptr;
 		}
 
-		//	check if we need to start at an offset from the beginning of the page
-		//	because of alignment requirements, and also whether the request can fit
-		void* aligned_start = &storage[0];
-		auto  aligned_space = total_size;
-		if (std::align(alignof(T), bytes_needed, aligned_start, aligned_space) == nullptr) {
-			return nullptr;	// page can't have enough space for this #bytes, after alignment
+		//	distance between locations whose addresses are aligned for a T
+		//	(lcm(alignof(T), min_alloc) / min_alloc, since neither need be a
+		//	multiple of the other), and the first such location, which is not 0
+		//	if T is aligned more strictly than the page's storage
+		const auto locations_step = alignof(T) / detail::gcd(alignof(T), min_alloc);
+		std::size_t first = 0;
+		while (first < locations_step
+			&& reinterpret_cast<std::uintptr_t>(&storage[first*min_alloc]) % alignof(T) != 0) {
+			++first;
+		}
+		if (first == locations_step) {
+			return nullptr;	// no location in this page is aligned for a T
 		}
-
-		//	alignment of location needed by a T
-		const auto locations_step = 1 + (alignof(T)-1) / min_alloc;
 
 		//	# contiguous locations needed total
 		//	note: as a simplification, for now we just add an extra location to every 
 		//	      allocation as a simple way to support one-past-the-end arithmetic
 		const auto locations_needed = (1 + (bytes_needed - 1) / min_alloc) + 1;
 
+		if (locations_needed >= (std::size_t)locations()) {
+			return nullptr;	// a request this big can never fit in this page
+		}
+
 		const auto end = locations() - locations_needed;
 		//	intentionally omitting "+1" here in order to keep the 
 		//	last location valid for one-past-the-end pointing
 
 		//	for each correctly aligned location candidate
-		std::size_t i = ((byte*)aligned_start - &storage[0]) / min_alloc;
-		Expects(i == 0 && "temporary debug check: the current test harness shouldn't have generated something that required a starting offset for alignment reasons");
-		for (; i < end; i += locations_step) {
+		std::size_t i = first;
+		while (i < end) {
 			//	check to see whether we have enough free locations starting here
 			std::size_t j = 0;
 			//	Future: replace this loop with a function call
 			for (; j < locations_needed; ++j) {
 				// if any location is in use, keep going
 				if (inuse.get(i + j)) {
-					// optimization: bump i to avoid probing the same location twice
-					i += j;
 					break;
 				}
 			}
@@ -191,12 +451,20 @@ namespace gcpp {
 			// if we have enough free locations, break the outer loop
 			if (j == locations_needed)
 				break;
+
+			// optimization: bump i to the first aligned candidate past the
+			// location in use, to avoid probing the same location twice
+			i += (j / locations_step + 1) * locations_step;
 		}
 
 		//	if we didn't find anything, return null
 		if (i >= end) {
 			//	optimization: remember that we couldn't satisfy this request size
-			current_known_request_bound = std::min(current_known_request_bound, bytes_needed - 1);
+			//	(only if alignment played no part, else a less-aligned request
+			//	of the same size might still fit)
+			if (locations_step == 1 && first == 0) {
+				current_known_request_bound = std::min(current_known_request_bound, bytes_needed - 1);
+			}
 			return nullptr;
 		}
 
@@ -206,6 +474,8 @@ namespace gcpp {
 
 		//	optimization: remember that we have this much less memory free
 		current_known_request_bound -= min_alloc * locations_needed;
+		++current_allocations;
+		current_locations_in_use += locations_needed;
 
 		//	... and return the storage
 		return &storage[i*min_alloc];
@@ -236,7 +506,7 @@ namespace gcpp {
 			while (start > 0 && !starts.get(start - 1)) {
 				--start;
 			}
-			Expects(start > 0 && "there was no start to this allocation");
+			GCPP_EXPECTS(start > 0 && "there was no start to this allocation");
 			return{ in_range_allocated_middle, where, start - 1 };
 		}
 
@@ -249,10 +519,27 @@ namespace gcpp {
 	inline 
 	gpage::location_info_ret
 	gpage::location_info(int where) const noexcept {
+		//	allow asking about the one-past-the-end location, to get its pointer
+		if (where == locations()) {
+			return{ false, &storage[where*min_alloc] };
+		}
 		return{ starts.get(where), &storage[where*min_alloc] };
 	}
 
 
+	//  Return the end of the allocation that starts at this location.
+	//
+	inline
+	byte* gpage::allocation_end(std::size_t start) const noexcept {
+		GCPP_EXPECTS(starts.get(start) && "not the start of an allocation");
+		auto end = start + 1;
+		while ((int)end < locations() && inuse.get(end) && !starts.get(end)) {
+			++end;
+		}
+		return &storage[end*min_alloc];
+	}
+
+
 	//  Deallocate space for object(s) of type T
 	//
 	inline
@@ -261,12 +548,13 @@ namespace gcpp {
 
 		// p had better point to our storage and to the start of an allocation
 		// (note: we could also check alignment here but that seems superfluous)
-		Expects(0 <= here && here < locations() && "attempt to deallocate - out of range");
-		Expects(starts.get(here) && "attempt to deallocate - not at start of a valid allocation");
-		Expects(inuse.get(here) && "attempt to deallocate - location is not in use");
+		GCPP_EXPECTS(0 <= here && here < locations() && "attempt to deallocate - out of range");
+		GCPP_EXPECTS(starts.get(here) && "attempt to deallocate - not at start of a valid allocation");
+		GCPP_EXPECTS(inuse.get(here) && "attempt to deallocate - location is not in use");
 
 		// reset 'starts' to erase the record of the start of this allocation
 		starts.set(here, false);
+		--current_allocations;
 
 		// scan 'starts' to find the start of the following allocation, if any
 		//	TODO replace this loop with a function call
@@ -289,7 +577,64 @@ namespace gcpp {
 		while (here < next_start && inuse.get(here)) {
 			inuse.set(here, false);
 			++here;
+			--current_locations_in_use;
+		}
+	}
+
+
+	//	Check that the tracking information is consistent
+	//
+	inline
+	const char* gpage::verify() const noexcept {
+		std::size_t starts_seen = 0;
+		std::size_t inuse_seen = 0;
+		for (int i = 0; i < locations(); ++i) {
+			auto used = inuse.get(i);
+			auto start = starts.get(i);
+			if (start && !used) {
+				return "an allocation starts at an unused location";
+			}
+			if (used && !start && (i == 0 || !inuse.get(i - 1))) {
+				return "an in-use location is not part of any allocation";
+			}
+			starts_seen += start;
+			inuse_seen += used;
+		}
+		if (starts_seen != current_allocations) {
+			return "the page's allocation count does not match its starts";
 		}
+		if (inuse_seen != current_locations_in_use) {
+			return "the page's in-use count does not match its locations in use";
+		}
+		return nullptr;
+	}
+
+
+	//	Deallocate everything at once by clearing the tracking bitmaps
+	//
+	inline
+	void gpage::clear() noexcept {
+		inuse.set_all(false);
+		starts.set_all(false);
+		current_known_request_bound = total_size;
+		current_allocations = 0;
+		current_locations_in_use = 0;
+	}
+
+	//	Give the physical memory behind an empty page back to the OS
+	//
+	inline
+	void gpage::discard() noexcept {
+		GCPP_EXPECTS(is_empty() && "cannot discard a page that has allocations");
+#if defined(_WIN32)
+		if (storage.get_deleter().kind != gpage_storage::heap) {
+			VirtualAlloc(storage.get(), total_size, MEM_RESET, PAGE_READWRITE);
+		}
+#elif defined(__unix__) || defined(__APPLE__)
+		if (storage.get_deleter().kind != gpage_storage::heap) {
+			madvise(storage.get(), total_size, MADV_DONTNEED);
+		}
+#endif
 	}
 
 
@@ -297,7 +642,7 @@ namespace gcpp {
 	//
 	inline
 	std::string lowest_hex_digits_of_address(byte* p, int num = 1) {
-		Expects(0 < num && num < 9 && "number of digits must be 0..8");
+		GCPP_EXPECTS(0 < num && num < 9 && "number of digits must be 0..8");
 		static const char digits[] = "0123456789ABCDEF";
 
 		std::string ret(num, ' ');
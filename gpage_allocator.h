@@ -21,48 +21,212 @@
 
 #include "gpage.h"
 
+#include <map>
+#include <memory>
+#include <vector>
+#include <new>
+
 namespace gcpp {
 
 	//----------------------------------------------------------------------------
 	//
-	//	gpage_allocator - wrap a gpage as a C++14 allocator, with thanks to
+	//	gpage_arena - A growable chain of gpages used as a non-collected pool.
+	//
+	//  pages			The chain; a new page is added whenever no existing page
+	//					can satisfy a request, and pages are kept once added
+	//  by_address		Index of pages by their starting address, for deallocate
+	//  with_room		Indexes of pages that have had space freed since they last
+	//					failed a request; with the newest page, the only pages
+	//					allocate() tries, so a request costs O(1) amortized probes
+	//					(a freed gap too small for a request is only found again
+	//					after the page's next deallocation)
+	//  page_size		Default size of each new page (larger if a single request
+	//					needs more)
+	//  min_alloc		Location size of each page
+	//
+	//	Not copyable or movable: allocators refer to the arena by address.
+	//
+	//----------------------------------------------------------------------------
+
+	class gpage_arena {
+		struct arena_page {
+			std::unique_ptr<gpage>	page;
+			bool					in_with_room = false;
+		};
+		std::vector<arena_page>				pages;
+		std::map<const byte*, std::size_t>	by_address;
+		std::vector<std::size_t>			with_room;
+		const std::size_t					page_size;
+		const std::size_t					min_alloc;
+		const gpage_storage					storage;
+
+		gpage_arena(gpage_arena&) = delete;
+		void operator=(gpage_arena&) = delete;
+
+		//	Return the page size needed to hold n objects of type T, including
+		//	gpage's one-past-the-end location and any alignment step.
+		//
+		template<class T>
+		std::size_t size_for(std::size_t n) const noexcept {
+			const auto locations = (sizeof(T)*n + min_alloc - 1) / min_alloc
+								 + 2 + (alignof(T) - 1) / min_alloc;
+			return std::max(page_size, locations * min_alloc);
+		}
+
+	public:
+		gpage_arena(std::size_t page_size_ = 4096, std::size_t min_alloc_ = 8,
+					gpage_storage storage_ = gpage_storage::heap)
+			: page_size{ (page_size_ + min_alloc_ - 1) / min_alloc_ * min_alloc_ }
+			, min_alloc{ min_alloc_ }
+			, storage{ storage_ }
+		{
+			GCPP_EXPECTS(min_alloc > 0 && page_size > 0 && "arena pages cannot be empty");
+		}
+
+		//  Allocate space for n objects of type T, adding a page if necessary.
+		//	Returns null only if a new page's storage can't be obtained.
+		//
+		template<class T>
+		T* allocate(std::size_t n = 1) {
+			//	try the newest page first, it is the least full
+			if (!pages.empty()) {
+				if (auto p = pages.back().page->allocate<T>(gsl::narrow_cast<int>(n))) {
+					return reinterpret_cast<T*>(p);
+				}
+			}
+
+			//	then the pages that have had space freed, dropping each one
+			//	that can't satisfy the request until it frees more
+			while (!with_room.empty()) {
+				auto& ap = pages[with_room.back()];
+				if (auto p = ap.page->allocate<T>(gsl::narrow_cast<int>(n))) {
+					return reinterpret_cast<T*>(p);
+				}
+				ap.in_with_room = false;
+				with_room.pop_back();
+			}
+
+			//	a page is listed in with_room at most once, so reserving room
+			//	for every page here keeps deallocate() from ever allocating
+			with_room.reserve(pages.size() + 1);
+			pages.reserve(pages.size() + 1);
+			auto pg = std::make_unique<gpage>(size_for<T>(n), min_alloc, storage);
+			by_address.emplace(static_cast<const byte*>(pg->begin()), pages.size());
+			pages.push_back({ std::move(pg) });
+			return reinterpret_cast<T*>(pages.back().page->allocate<T>(gsl::narrow_cast<int>(n)));
+		}
+
+		//  Allocate size bytes aligned to align (a power of two), for callers
+		//	that only know the request at run time.
+		//
+		void* allocate_bytes(std::size_t size, std::size_t align) {
+			return detail::with_aligned_unit(align, [&](auto* hint) -> void* {
+				using unit = std::remove_pointer_t<decltype(hint)>;
+				return allocate<unit>(std::max<std::size_t>(1, (size + sizeof(unit) - 1) / sizeof(unit)));
+			});
+		}
+
+		//  Deallocate the allocation that starts at p, which must have been
+		//	returned by allocate() on this arena.
+		//
+		void deallocate(gsl::not_null<void*> p) noexcept {
+			auto b = static_cast<byte*>(p.get());
+			auto it = by_address.upper_bound(b);
+			if (it != by_address.begin()) {
+				auto& ap = pages[(--it)->second];
+				if (ap.page->contains(b)) {
+					ap.page->deallocate(b);
+					if (!ap.in_with_room) {
+						ap.in_with_room = true;
+						with_room.push_back(it->second);	// can't throw, see allocate()
+					}
+					return;
+				}
+			}
+			GCPP_EXPECTS(false && "attempt to deallocate memory not owned by this arena");
+		}
+
+		//	Return the number of pages in the chain.
+		//
+		std::size_t page_count() const noexcept { return pages.size(); }
+
+		//	Return the total bytes reserved by all pages.
+		//
+		std::size_t bytes_reserved() const noexcept {
+			auto ret = std::size_t{ 0 };
+			for (auto& ap : pages) { ret += ap.page->size(); }
+			return ret;
+		}
+
+		//	Return the number of live allocations across all pages.
+		//
+		std::size_t allocations() const noexcept {
+			auto ret = std::size_t{ 0 };
+			for (auto& ap : pages) { ret += ap.page->allocations(); }
+			return ret;
+		}
+	};
+
+
+	//----------------------------------------------------------------------------
+	//
+	//	gpage_allocator - wrap a gpage_arena as a C++14 allocator, with thanks to
 	//			 Howard Hinnant's allocator boilerplate exemplar code, online at
 	//           https://howardhinnant.github.io/allocator_boilerplate.html
 	//
+	//	Allocators compare equal exactly when they share the same arena, so
+	//	memory from one can be deallocated through the other.
+	//
 	//----------------------------------------------------------------------------
 
-	static gpage page;
-
 	template <class T>
 	class gpage_allocator {
+		gpage_arena* a;
+
+		template <class U> friend class gpage_allocator;
 
 	public:
 		using value_type = T;
 
-		gpage_allocator() noexcept
+		gpage_arena& arena() const noexcept {
+			return *a;
+		}
+
+		gpage_allocator(gpage_arena& a_) noexcept
+			: a{ &a_ }
 		{
 		}
 
 		template <class U> 
-		gpage_allocator(gpage_allocator<U> const&) noexcept
+		gpage_allocator(gpage_allocator<U> const& that) noexcept
+			: a{ that.a }
 		{
 		}
 
-		value_type* allocate(std::size_t n) noexcept 
+		value_type* allocate(std::size_t n)
 		{
-			return page.allocate<T>(n);
+			auto p = a->allocate<T>(n);
+			if (p == nullptr) {
+				throw std::bad_alloc{};
+			}
+			return p;
 		}
 
 		void deallocate(value_type* p, std::size_t) noexcept 
 		{
-			return page.deallocate(p);
+			a->deallocate(p);
 		}
+
+		using propagate_on_container_copy_assignment = std::true_type;
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap            = std::true_type;
+		using is_always_equal                        = std::false_type;
 	};
 
 	template <class T, class U>
-	bool operator==(gpage_allocator<T> const&, gpage_allocator<U> const&) noexcept 
+	bool operator==(gpage_allocator<T> const& x, gpage_allocator<U> const& y) noexcept 
 	{ 
-		return true; 
+		return &x.arena() == &y.arena();
 	}
 
 	template <class T, class U>
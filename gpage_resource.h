@@ -0,0 +1,121 @@
+
+/////////////////////////////////////////////////////////////////////////////// 
+// 
+// Copyright (c) 2016 Herb Sutter. All rights reserved. 
+// 
+// This code is licensed under the MIT License (MIT). 
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN 
+// THE SOFTWARE. 
+// 
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef GCPP_GPAGE_RESOURCE
+#define GCPP_GPAGE_RESOURCE
+
+#include "gpage_allocator.h"
+#include "deferred_heap.h"
+
+#include <memory_resource>
+#include <unordered_map>
+
+namespace gcpp {
+
+	//----------------------------------------------------------------------------
+	//
+	//	gpage_resource - expose a gpage_arena as a std::pmr::memory_resource, so
+	//			 that std::pmr containers can allocate from gpages without any
+	//			 change to their types
+	//
+	//	The resource owns its arena. Two resources compare equal only if they
+	//	are the same object.
+	//
+	//----------------------------------------------------------------------------
+
+	class gpage_resource : public std::pmr::memory_resource {
+		gpage_arena a;
+
+	public:
+		gpage_resource(std::size_t page_size = 4096, std::size_t min_alloc = 8,
+					   gpage_storage storage = gpage_storage::heap)
+			: a{ page_size, min_alloc, storage }
+		{ }
+
+		gpage_arena& arena() noexcept { return a; }
+
+	private:
+		void* do_allocate(std::size_t bytes, std::size_t align) override {
+			auto p = a.allocate_bytes(bytes, align);
+			if (p == nullptr) {
+				throw std::bad_alloc{};
+			}
+			return p;
+		}
+
+		void do_deallocate(void* p, std::size_t, std::size_t) override {
+			a.deallocate(p);
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource& that) const noexcept override {
+			return this == &that;
+		}
+	};
+
+
+	//----------------------------------------------------------------------------
+	//
+	//	deferred_heap_resource - expose a deferred_heap as a
+	//			 std::pmr::memory_resource
+	//
+	//	A pmr container holds raw pointers, which the collector cannot see, so
+	//	each allocation is kept alive by a deferred_ptr held here until it is
+	//	deallocated; its memory is then reclaimed by the heap's next collection.
+	//	The resource must not outlive its heap.
+	//
+	//----------------------------------------------------------------------------
+
+	class deferred_heap_resource : public std::pmr::memory_resource {
+		deferred_heap& h;
+		std::unordered_map<void*, deferred_ptr<void>> pins;
+
+	public:
+		deferred_heap_resource(deferred_heap& h_)
+			: h{ h_ }
+		{ }
+
+		deferred_heap& heap() const noexcept { return h; }
+
+		//	Return the number of allocations currently kept alive.
+		//
+		std::size_t pinned() const noexcept { return pins.size(); }
+
+	private:
+		void* do_allocate(std::size_t bytes, std::size_t align) override {
+			auto p = h.allocate_bytes(bytes, align);
+			if (p.get() == nullptr) {
+				throw std::bad_alloc{};	// e.g., the heap's max_heap_bytes is reached
+			}
+			auto raw = p.get();
+			pins.emplace(raw, std::move(p));
+			return raw;
+		}
+
+		void do_deallocate(void* p, std::size_t, std::size_t) override {
+			auto erased = pins.erase(p);
+			GCPP_EXPECTS(erased == 1 && "attempt to deallocate memory not allocated by this resource");
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource& that) const noexcept override {
+			return this == &that;
+		}
+	};
+
+}
+
+#endif
@@ -23,13 +23,27 @@
 //----------------------------------------------------------------------------
 
 #include "deferred_allocator.h"
+#include "collect_trace.h"
+#include "deferred_span.h"
+#include "gpage_resource.h"
+#include "deferred_weak_map.h"
 using namespace gcpp;
 
 #include <iostream>
 #include <vector>
 #include <set>
 #include <array>
-#include <chrono>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <list>
+#include <optional>
+#include <cstdint>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 using namespace std;
 
 
@@ -157,49 +171,6 @@ void test_deferred_heap() {
 }
 
 
-//----------------------------------------------------------------------------
-//
-//	Some timing of deferred_heap.
-//
-//----------------------------------------------------------------------------
-
-template<class T>
-void time_shared(int N) {
-	vector<shared_ptr<T>> v;
-	auto start = std::chrono::high_resolution_clock::now();
-	for (int i = 0; i < N; ++i)
-		v.push_back(make_shared<T>());
-	auto end = std::chrono::high_resolution_clock::now();
-	cout << "shared_ptr (" << N << ") time: "
-		<< std::chrono::duration<double, std::milli>(end - start).count()
-		<< "ms  ";
-}
-
-template<class T>
-void time_deferred(deferred_heap& heap, int N) {
-	vector<deferred_ptr<T>> v;
-	auto start = std::chrono::high_resolution_clock::now();
-	for (int i = 0; i < N; ++i) {
-		v.push_back(heap.make<T>());
-	}
-	auto end = std::chrono::high_resolution_clock::now();
-	cout << "\tdeferred_ptr (" << N << ") time: "
-		<< std::chrono::duration<double, std::milli>(end - start).count()
-		<< "ms\n";
-}
-
-void time_deferred_heap() {
-	deferred_heap heap;
-	for (int i = 10; i < 11000; i *= 2) {
-		time_shared<int>(i);
-		time_deferred<int>(heap, i);
-	}
-	//heap.debug_print();
-	//heap.collect();
-	//heap.debug_print();
-}
-
-
 //----------------------------------------------------------------------------
 //
 //	Basic use of a deferred_allocator on its own, just to make sure it's wired up
@@ -309,105 +280,1527 @@ void test_deferred_allocator_vector() {
 }
 
 
+void test_deferred_array() {
+	deferred_heap heap;
+	vector<deferred_ptr<widget>> v;
+
+	v.push_back(heap.make_array<widget>(3));
+	heap.debug_print();
+
+	v.push_back(heap.make_array<widget>(2));
+	heap.debug_print();
+
+	v.push_back(heap.make_array<widget>(4));
+
+	heap.debug_print();
+
+	v.push_back(heap.make_array<widget>(3));
+
+	heap.debug_print();
+
+	v.erase(v.begin() + 2);
+
+	heap.collect();
+	heap.debug_print();
+
+}
+
+
 //----------------------------------------------------------------------------
 //
-//	Some timing of deferred_allocator with set and vector.
+//	Check that empty pages are returned to the system after a spike.
 //
 //----------------------------------------------------------------------------
 
-template<class Set>
-void time_set(Set s, const char* sz, int N) {
-	auto start = std::chrono::high_resolution_clock::now();
-	for (int i = 0; i < N; ++i)
-		s.insert(i);
-	auto end = std::chrono::high_resolution_clock::now();
-	cout << sz << "(" << N << ") time: "
-		<< std::chrono::duration<double, std::milli>(end - start).count()
-		<< "ms\n";
+#if defined(__SANITIZE_ADDRESS__)
+#define GCPP_TEST_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define GCPP_TEST_ASAN 1
+#endif
+#endif
+
+//	Resident set size in KB, or 0 where we don't know how to measure it
+//	(including under AddressSanitizer, which quarantines freed memory
+//	instead of giving it back)
+//
+long resident_kb() {
+#if defined(__linux__) && !defined(GCPP_TEST_ASAN)
+	long pages = 0, resident = 0;
+	ifstream("/proc/self/statm") >> pages >> resident;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+	return 0;
+#endif
 }
 
-void time_deferred_allocator_set() {
-#ifndef __GNUC__
+void test_shrink_to_fit() {
 	deferred_heap heap;
-	auto s = set<int>();
-	auto s2 = deferred_set<int>(heap);
+	heap.set_empty_page_retention(100);	// so that collect() keeps the pages
+	auto keep = heap.make<int>(42);		// on a page of its own
+	auto rss_before = resident_kb();
 
-	for (int i = 10; i < 11000; i *= 2) {
-		time_set(s, "set<int>", i);
-		time_set(s2, "deferred_set<int>", i);
-		//heap.debug_print();
-		//heap.collect();
-		//heap.debug_print();
+	//	each page is bigger than malloc's largest mmap threshold, so that
+	//	freeing it really does unmap it
+	const int count = 4, ints = 3 * 1024 * 1024;
+	{
+		vector<deferred_ptr<int>> v;
+		for (int i = 0; i < count; ++i) {
+			v.push_back(heap.make_array<int>(ints));
+			std::fill_n(v.back().get(), ints, i);	// touch every page
+		}
+		cout << "RSS with " << count << " live arrays:  " << resident_kb() - rss_before << "KB\n";
 	}
-#endif
+
+	heap.collect();
+	auto rss_collected = resident_kb();
+	cout << "RSS after collect:       " << rss_collected - rss_before << "KB\n";
+
+	heap.shrink_to_fit();
+	auto rss_shrunk = resident_kb();
+	cout << "RSS after shrink_to_fit: " << rss_shrunk - rss_before << "KB\n";
+	Expects(*keep == 42 && "live object must survive shrink_to_fit");
+
+	//	most of what we touched must have been given back
+	auto touched_kb = long(count * ints * sizeof(int) / 1024);
+	Expects((rss_collected == 0 || rss_collected - rss_shrunk >= touched_kb * 3 / 4)
+		&& "shrink_to_fit did not return the empty pages to the system");
 }
 
-template<class Vec>
-void time_vec(Vec v, const char* sz, int N) {
-	auto start = std::chrono::high_resolution_clock::now();
-	for (int i = 0; i < N; ++i)
-		v.push_back(i);
-	auto end = std::chrono::high_resolution_clock::now();
-	cout << sz << "(" << N << ") time: "
-		<< std::chrono::duration<double, std::milli>(end - start).count()
-		<< "ms\n";
+void test_mapped_pages() {
+	deferred_heap heap;
+	heap.set_page_storage(gpage_storage::mapped);
+	heap.set_empty_page_retention(1);
+	auto rss_before = resident_kb();
+
+	auto p = heap.make_array<int>(1024 * 1024);	// reserved, but not yet touched
+	cout << "RSS after mapping 4MB:   " << resident_kb() - rss_before << "KB\n";
+
+	std::fill_n(p.get(), 1024 * 1024, 1);
+	cout << "RSS after touching it:   " << resident_kb() - rss_before << "KB\n";
+
+	p = nullptr;
+	heap.collect();	// page is now empty and retained, but discarded
+	cout << "RSS after collect:       " << resident_kb() - rss_before << "KB\n";
+
+	p = heap.make_array<int>(1024 * 1024);	// reuses the retained page
+	Expects(p != nullptr && "failed to reuse a retained page");
 }
 
-void time_deferred_allocator_vector() {
+
+//----------------------------------------------------------------------------
+//
+//	Share one deferred_heap between several threads.
+//
+//----------------------------------------------------------------------------
+
+void test_thread_safe_heap() {
 	deferred_heap heap;
-	auto v = vector<widget>();
-	auto v2 = deferred_vector<widget>(heap);
+	heap.set_thread_safe(true);
+
+	struct link {
+		deferred_ptr<link> next;
+		int value = 0;
+	};
+
+	deferred_ptr<link> shared_list;	// guarded by m
+	std::mutex m;
+	const int threads = 4, per_thread = 2000;
+
+	vector<thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t] {
+			heap.attach_thread();
+			for (int i = 0; i < per_thread; ++i) {
+				auto p = heap.make<link>();
+				p->value = t;
+				if (i % 2 == 0) {	// keep half, drop the rest
+					lock_guard<std::mutex> hold(m);
+					p->next = shared_list;
+					shared_list = p;
+				}
+				heap.safepoint();
+			}
+			heap.detach_thread();
+		});
+	}
+
+	for (int i = 0; i < 10; ++i) {
+		heap.collect();
+	}
+	for (auto& w : workers) {
+		w.join();
+	}
+	heap.collect();
 
-	for (int i = 10; i < 11000; i *= 2) {
-		//time_vec(v, "vector<int>", i);
-		time_vec(v, "deferred_vector<int>", i);
-		//heap.debug_print();
-		//heap.collect();
-		//heap.debug_print();
+	int count = 0;
+	for (auto p = shared_list; p != nullptr; p = p->next) {
+		++count;
 	}
+	cout << "threads kept " << count << " of " << threads * per_thread << " links\n";
+	Expects(count == threads * per_thread / 2 && "lost or leaked a shared link");
 }
 
-void test_deferred_array() {
+
+//----------------------------------------------------------------------------
+//
+//	Attached threads allocate from their own pages and record registrations
+//	in their own buffers; the heap must still add up, including for
+//	deferred_ptrs created on one thread and destroyed on another.
+//
+//----------------------------------------------------------------------------
+
+void test_thread_local_buffers() {
 	deferred_heap heap;
-	vector<deferred_ptr<widget>> v;
+	heap.set_thread_safe(true);
 
-	v.push_back(heap.make_array<widget>(3));
-	heap.debug_print();
+	struct node {
+		deferred_ptr<node> next;
+		std::atomic<int>* destroyed;
+		node(std::atomic<int>& d) : destroyed{ &d } { }
+		~node() { ++*destroyed; }
+	};
+	std::atomic<int> destroyed{ 0 };
 
-	v.push_back(heap.make_array<widget>(2));
-	heap.debug_print();
+	//	one deferred_ptr is deregistered (on this thread) before the thread
+	//	that created it has merged its registration
+	{
+		deferred_ptr<node>* handed = nullptr;
+		std::atomic<bool> made{ false }, deleted{ false };
+		thread t{ [&] {
+			heap.attach_thread();
+			handed = new deferred_ptr<node>(heap.make<node>(destroyed));
+			made = true;
+			while (!deleted) {
+				std::this_thread::yield();
+			}
+			heap.detach_thread();
+		} };
+		while (!made) {
+			std::this_thread::yield();
+		}
+		delete handed;
+		deleted = true;
+		t.join();
+	}
+	Expects(heap.verify() == nullptr && "a stray deregistration was not matched");
+	heap.collect();
+	Expects(destroyed == 1 && heap.stats().live_allocations == 0);
+
+	//	several threads build lists, with temporaries along the way, while
+	//	this thread collects
+	const int threads = 4, per_thread = 5000;
+	vector<deferred_ptr<node>> lists(threads);
+	std::atomic<int> running{ threads };
+	vector<thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t] {
+			heap.attach_thread();
+			deferred_ptr<node> head;
+			for (int i = 0; i < per_thread; ++i) {
+				auto p = heap.make<node>(destroyed);
+				auto q = p;	// registered and deregistered in the buffer alone
+				q->next = head;
+				head = q;
+				if (i % 100 == 0) {
+					heap.safepoint();
+				}
+			}
+			lists[t] = head;	// each thread has its own element
+			head = nullptr;
+			heap.detach_thread();
+			--running;
+		});
+	}
+	while (running > 0) {
+		heap.collect();
+		std::this_thread::yield();
+	}
+	for (auto& w : workers) {
+		w.join();
+	}
 
-	v.push_back(heap.make_array<widget>(4));
+	auto s = heap.stats();
+	Expects(s.total_allocations == 1 + threads * per_thread && "lost an allocation's count");
+	Expects(s.roots == threads && "the lists' heads should be the only roots");
+	Expects(heap.verify() == nullptr);
 
-	heap.debug_print();
+	heap.collect();
+	int count = 0;
+	for (auto& head : lists) {
+		for (auto p = head; p != nullptr; p = p->next) {
+			++count;
+		}
+	}
+	cout << "threads kept " << count << " of " << threads * per_thread << " nodes in "
+		<< heap.stats().pages << " pages\n";
+	Expects(count == threads * per_thread && destroyed == 1 && "lost a node");
 
-	v.push_back(heap.make_array<widget>(3));
+	lists.clear();
+	heap.collect();
+	Expects(destroyed == 1 + threads * per_thread && heap.stats().live_allocations == 0);
+}
 
-	heap.debug_print();
 
-	v.erase(v.begin() + 2);
+//----------------------------------------------------------------------------
+//
+//	Interleave program work with an incremental collection.
+//
+//----------------------------------------------------------------------------
+
+void test_incremental_collect() {
+	deferred_heap heap;
+
+	struct item {
+		deferred_ptr<item> next;
+		deferred_ptr<item> other;
+		int value = 0;
+		~item() { value = -1; }
+	};
+
+	auto a = heap.make<item>();
+	a->other = a;	// traced first, since it's the first to be registered
+	a->next = heap.make<item>();
+	a->next->next = heap.make<item>();
+	a->next->next->value = 3;
+	auto garbage = heap.make<item>();
+	garbage->next = garbage;
+	garbage = nullptr;
+
+	Expects(!heap.collect_step(1) && "marking should need more than one step");
+
+	//	move the only reference to the third item to a place marking has
+	//	already passed; the write barrier must keep the item alive
+	a->other = a->next->next;
+	a->next->next = nullptr;
+
+	//	objects allocated during marking are kept, too
+	a->next->other = heap.make<item>();
+	a->next->other->value = 4;
+
+	while (!heap.collect_step(1)) {
+	}
 
+	Expects(a->other && a->other->value == 3 && "write barrier lost an object");
+	Expects(a->next->other && a->next->other->value == 4 && "lost an object allocated during marking");
+
+	//	destroying a deferred_ptr during marking (here one in an object that
+	//	hasn't been traced yet) must keep what it pointed to
+	struct holder {
+		optional<deferred_ptr<item>> slot;
+	};
+	auto h = heap.make<holder>();
+	h->slot = heap.make<item>();
+	(*h->slot)->value = 5;
+	Expects(!heap.collect_step(0) && "marking should be in progress");
+	deferred_ptr<item> kept = *h->slot;
+	h->slot.reset();
+	while (!heap.collect_step(1)) {
+	}
+	Expects(kept->value == 5 && "destroying a deferred_ptr lost an object");
+	cout << "incremental collection kept all reachable objects\n";
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	A background collector marks in steps on its own thread, while the
+//	program keeps allocating and repointing.
+//
+//----------------------------------------------------------------------------
+
+void test_background_collection() {
+	deferred_heap heap;
+	heap.set_thread_safe(true);
+	heap.set_background_collection(true, 10);
+	heap.attach_thread();
+
+	struct item {
+		deferred_ptr<item> next;
+		int value = 0;
+	};
+
+	//	a list that stays reachable, and as much garbage
+	deferred_ptr<item> list;
+	for (int i = 0; i < 1000; ++i) {
+		auto n = heap.make<item>();
+		n->value = i;
+		n->next = list;
+		list = n;
+		heap.make<item>();
+	}
+
+	//	keep splicing new items into the list while the collector runs
+	auto before = heap.stats().collections;
+	heap.collect_in_background();
+	int added = 0;
+	while (heap.stats().collections == before) {
+		auto n = heap.make<item>();
+		n->value = -1;
+		n->next = list->next;
+		list->next = n;
+		++added;
+		heap.safepoint();
+	}
+
+	int count = 0, original = 0;
+	for (auto p = list; p != nullptr; p = p->next) {
+		++count;
+		original += p->value >= 0;
+	}
+	Expects(original == 1000 && count == 1000 + added && "the background collector lost an object");
+	Expects(heap.stats().live_allocations == (size_t)count && "the background collector kept garbage");
+
+	//	the allocation threshold wakes it, too
+	collect_policy policy;
+	policy.allocation_threshold = 16 * 1024;
+	heap.set_collect_policy(policy);
+	before = heap.stats().collections;
+	while (heap.stats().collections == before) {
+		heap.make<item>();
+		heap.safepoint();
+	}
+	cout << "background collection kept " << count << " items while " << added << " were added\n";
+
+	heap.set_background_collection(false);
+	heap.detach_thread();
+
+	{
+		deferred_heap other;
+		other.set_thread_safe(true);
+		other.set_background_collection(true);
+		other.make<item>();
+		other.collect_in_background();
+	}	// the destructor stops the collector
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Generational collection: minor collections reclaim young objects only.
+//
+//----------------------------------------------------------------------------
+
+struct gen_node {
+	static int destroyed;
+	deferred_ptr<gen_node> next;
+	int value = 0;
+	~gen_node() { ++destroyed; }
+};
+int gen_node::destroyed = 0;
+
+void test_generational() {
+	deferred_heap heap;
+	heap.set_generational(true);
+
+	auto old = heap.make<gen_node>();
+	heap.make<gen_node>();	// young garbage
+	heap.collect_minor();
+	Expects(gen_node::destroyed == 1 && "minor collection missed young garbage");
+
+	//	a young object reachable only from a promoted one must survive
+	old->next = heap.make<gen_node>();
+	old->next->value = 42;
+	heap.make<gen_node>();	// more young garbage
+	heap.collect_minor();
+	Expects(gen_node::destroyed == 2 && "minor collection missed young garbage");
+	Expects(old->next && old->next->value == 42 && "lost an object referenced from an old one");
+
+	//	promoted objects are only reclaimed by a full collection
+	old = nullptr;
+	heap.collect_minor();
+	Expects(gen_node::destroyed == 2 && "minor collection reclaimed an old object");
 	heap.collect();
-	heap.debug_print();
+	Expects(gen_node::destroyed == 4 && "full collection missed old garbage");
+	cout << "generational collection reclaimed " << gen_node::destroyed << " objects\n";
+}
+
+//	Promoted pages must be allocated from again once a full collection has
+//	emptied them out, or a heap with a steady live set grows without bound
+//
+void test_generational_footprint() {
+	deferred_heap heap;
+	heap.set_generational(true);
+
+	vector<deferred_ptr<gen_node>> live;	// a sliding window of survivors
+	std::size_t most_reserved = 0;
+	for (int i = 0; i < 1000; ++i) {
+		live.push_back(heap.make<gen_node>());
+		if (live.size() > 50) {
+			live.erase(live.begin());
+		}
+		for (int j = 0; j < 10; ++j) {
+			heap.make<gen_node>();	// young garbage
+		}
+
+		heap.collect_minor();
+		if (i % 10 == 9) {
+			heap.collect();
+		}
+		most_reserved = std::max(most_reserved, heap.stats().bytes_reserved);
+	}
 
+	auto s = heap.stats();
+	cout << "generational heap: " << s.live_allocations << " live in "
+		<< s.pages << " pages, at most " << most_reserved << " bytes reserved\n";
+	Expects(most_reserved <= 4 * 8192
+		&& "generational heap keeps growing with a steady live set");
 }
 
 
-int main() {
-	//test_page();
+//----------------------------------------------------------------------------
+//
+//	Compaction moves live objects out of sparse pages and fixes up pointers.
+//
+//----------------------------------------------------------------------------
 
-	test_deferred_heap();
-	//time_deferred_heap();
+struct compact_node {
+	static int live;
+	deferred_ptr<compact_node> next;
+	int value = 0;
+	compact_node() { ++live; }
+	compact_node(compact_node&& that) noexcept : next{ that.next }, value{ that.value } { ++live; }
+	~compact_node() { --live; }
+};
+int compact_node::live = 0;
+
+//	A move that may throw could leave a compaction half done, so objects
+//	like this are never moved
+struct pinned_node {
+	int value = 0;
+	pinned_node() = default;
+	pinned_node(pinned_node&& that) : value{ that.value } { }
+};
 
-	//test_deferred_allocator();
+//	An object that can be moved just because its deferred_ptr can: it has
+//	no move constructor of its own
+struct linked_node {
+	deferred_ptr<linked_node> next;
+	int value = 0;
+};
+static_assert(is_nothrow_move_constructible<linked_node>::value,
+	"a deferred_ptr member shouldn't pin its object");
 
-	//test_deferred_allocator_set();
-	//time_deferred_allocator_set();
+void test_compact() {
+	deferred_heap heap;
+	heap.set_compaction(true);
 
-	//test_deferred_allocator_vector();
-	//time_deferred_allocator_vector();
+	//	fill several pages, then keep only every 20th node, linked in a cycle
+	vector<deferred_ptr<compact_node>> v;
+	for (int i = 0; i < 2000; ++i) {
+		v.push_back(heap.make<compact_node>());
+		v.back()->value = i;
+	}
+	vector<deferred_ptr<compact_node>> kept;
+	for (int i = 0; i < 2000; i += 20) {
+		kept.push_back(v[i]);
+	}
+	for (size_t i = 0; i < kept.size(); ++i) {
+		kept[i]->next = kept[(i + 1) % kept.size()];
+	}
+	vector<compact_node*> before;
+	for (auto& p : kept) {
+		before.push_back(p.get());
+	}
+	v.clear();
 
-	//test_deferred_array();
+	vector<deferred_ptr<pinned_node>> pinned;
+	for (int i = 0; i < 2000; ++i) {
+		auto p = heap.make<pinned_node>();
+		if (i % 20 == 0) {
+			pinned.push_back(p);
+		}
+	}
+	vector<pinned_node*> pinned_before;
+	for (auto& p : pinned) {
+		pinned_before.push_back(p.get());
+	}
+
+	heap.compact();
+
+	Expects(compact_node::live == (int)kept.size() && "compaction leaked or lost objects");
+	for (size_t i = 0; i < kept.size(); ++i) {
+		Expects(kept[i]->value == (int)i * 20 && "compaction corrupted an object");
+		Expects(kept[i]->next == kept[(i + 1) % kept.size()] && "compaction broke a link");
+	}
+	int moved = 0;
+	for (size_t i = 0; i < kept.size(); ++i) {
+		moved += kept[i].get() != before[i];
+	}
+	Expects(moved > 0 && "compaction should have emptied some sparse pages");
+	for (size_t i = 0; i < pinned.size(); ++i) {
+		Expects(pinned[i].get() == pinned_before[i] && "compaction moved an object whose move may throw");
+	}
+	cout << "compaction kept " << compact_node::live << " nodes, and moved " << moved << "\n";
+
+	kept.clear();
+	heap.collect();
+	Expects(compact_node::live == 0 && "compacted objects were not destroyed");
+
+	vector<deferred_ptr<linked_node>> links;
+	for (int i = 0; i < 2000; ++i) {
+		auto p = heap.make<linked_node>();
+		p->value = i;
+		if (i % 20 == 0) {
+			links.push_back(p);
+		}
+	}
+	for (size_t i = 0; i < links.size(); ++i) {
+		links[i]->next = links[(i + 1) % links.size()];
+	}
+	vector<linked_node*> links_before;
+	for (auto& p : links) {
+		links_before.push_back(p.get());
+	}
+
+	heap.compact();
+
+	moved = 0;
+	for (size_t i = 0; i < links.size(); ++i) {
+		Expects(links[i]->value == (int)i * 20 && links[i]->next == links[(i + 1) % links.size()]
+			&& "compaction broke an object holding a deferred_ptr");
+		moved += links[i].get() != links_before[i];
+	}
+	Expects(moved > 0 && "an object holding a deferred_ptr was pinned");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Collection triggers let allocation collect automatically.
+//
+//----------------------------------------------------------------------------
+
+struct counted {
+	static int destroyed;
+	int value = 0;
+	~counted() { ++destroyed; }
+};
+int counted::destroyed = 0;
+
+void test_collect_policy() {
+	{
+		//	collect after every 4KB allocated
+		deferred_heap heap;
+		collect_policy policy;
+		policy.allocation_threshold = 4096;
+		heap.set_collect_policy(policy);
+
+		for (int i = 0; i < 10000; ++i) {
+			heap.make<counted>();	// garbage
+		}
+		Expects(counted::destroyed > 9000 && "allocation threshold didn't trigger");
+	}
+
+	{
+		//	a hard cap: allocation fails only when a collection can't make room
+		deferred_heap heap;
+		collect_policy policy;
+		policy.max_heap_bytes = 64 * 1024;
+		heap.set_collect_policy(policy);
+
+		vector<deferred_ptr<int>> v;
+		for (int i = 0; i < 1000; ++i) {
+			auto p = heap.make_array<int>(1000);
+			if (!p) break;
+			v.push_back(p);
+		}
+		Expects(!v.empty() && v.size() < 1000 && "hard cap was not enforced");
+		auto held = v.size();
+
+		v.clear();
+		for (int i = 0; i < 1000; ++i) {
+			Expects(heap.make_array<int>(1000) != nullptr 
+				&& "hard cap failed an allocation that garbage could satisfy");
+		}
+		cout << "hard cap held " << held << " live arrays\n";
+	}
+
+	{
+		//	growth factor: collections happen at geometrically spaced sizes
+		deferred_heap heap;
+		collect_policy policy;
+		policy.growth_factor = 1.5;
+		int pages_added = 0;
+		policy.trigger = [&](auto&) { ++pages_added; return false; };
+		heap.set_collect_policy(policy);
+
+		counted::destroyed = 0;
+		vector<deferred_ptr<counted>> v;
+		for (int i = 0; i < 100000; ++i) {
+			auto p = heap.make<counted>();
+			if (i % 2 == 0) v.push_back(p);
+		}
+		Expects(counted::destroyed > 0 && "growth factor didn't trigger");
+		cout << "growth factor added " << pages_added << " pages without collecting, and reclaimed "
+			 << counted::destroyed << " objects\n";
+	}
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Heap statistics.
+//
+//----------------------------------------------------------------------------
+
+void test_heap_stats() {
+	deferred_heap heap;
+
+	vector<deferred_ptr<counted>> v;
+	for (int i = 0; i < 10; ++i) {
+		v.push_back(heap.make<counted>());
+	}
+	auto s = heap.stats();
+	Expects(s.pages == 1 && s.live_allocations == 10 && s.total_allocations == 10
+		&& "wrong allocation counts");
+	Expects(s.roots == 10 && s.interior_pointers == 0 && s.pending_destructors == 10
+		&& "wrong pointer or destructor counts");
+	Expects(s.bytes_used >= 10 * sizeof(counted) && s.bytes_used <= s.bytes_reserved
+		&& s.bytes_fragmented == s.bytes_reserved - s.bytes_used
+		&& "wrong byte counts");
+
+	v.resize(4);
+	heap.collect();
+
+	s = heap.stats();
+	Expects(s.collections == 1 && s.live_allocations == 4 && s.pending_destructors == 4
+		&& s.roots == 4 && "wrong counts after collect");
+	Expects(s.bytes_freed >= 6 * sizeof(counted) && s.total_allocations == 10
+		&& "wrong cumulative counts");
+	Expects(s.total_pause.total() == s.last_pause.total() && "wrong pause totals");
+	cout << "collected " << s.bytes_freed << " bytes in " 
+		 << s.last_pause.total().count() << "ns\n";
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Collection phases can be observed, e.g. to write a trace.
+//
+//----------------------------------------------------------------------------
+
+void test_collect_trace() {
+	deferred_heap heap;
+	ostringstream json;
+
+	vector<collect_event> events;
+	{
+		chrome_trace_writer trace{ json };
+		heap.set_collect_observer([&](const collect_event& e) {
+			events.push_back(e);
+			trace(e);
+		});
+
+		//	a list of 10 nodes, plus 5 unreachable ones
+		auto head = heap.make<compact_node>();
+		auto p = head;
+		for (int i = 1; i < 10; ++i) {
+			p->next = heap.make<compact_node>();
+			p = p->next;
+		}
+		for (int i = 0; i < 5; ++i) {
+			heap.make<compact_node>();
+		}
+		p = nullptr;
+
+		heap.collect();
+		heap.set_collect_observer();
+	}
+
+	//	reset, mark (roots), mark (interior), null, sweep
+	Expects(events.size() == 5 && "expected one event per phase");
+	Expects(string(events[0].phase) == "reset" && string(events.back().phase) == "sweep"
+		&& "phases reported out of order");
+	size_t marked = 0, traced = 0;
+	for (auto& e : events) {
+		if (string(e.phase) == "mark") {
+			marked += e.objects_visited;
+			traced += e.edges_traced;
+		}
+	}
+	Expects(marked == 10 && traced == 11 && "wrong marking counts");
+	Expects(events.back().objects_visited == 5 && "wrong sweep count");
+	Expects(json.str().find("\"traceEvents\"") != string::npos 
+		&& json.str().find("\"name\":\"sweep\"") != string::npos
+		&& "trace is missing events");
+	cout << json.str();
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	The allocation profiler reports what's live by the code that allocated it.
+//
+//----------------------------------------------------------------------------
+
+GCPP_NOINLINE void allocate_kept(deferred_heap& heap, vector<deferred_ptr<int>>& v) {
+	for (int i = 0; i < 100; ++i) {
+		v.push_back(heap.make<int>(i));
+	}
+}
+
+GCPP_NOINLINE void allocate_garbage(deferred_heap& heap) {
+	for (int i = 0; i < 100; ++i) {
+		heap.make<double>(i * 1.0);
+	}
+}
+
+void test_allocation_profile() {
+	deferred_heap heap;
+	heap.set_allocation_sampling(1);	// every allocation, for the test
+
+	vector<deferred_ptr<int>> v;
+	allocate_kept(heap, v);
+	allocate_garbage(heap);
+	heap.collect();
+
+	auto profile = heap.allocation_profile();
+	Expects(profile.size() == 1 && profile[0].samples == 100
+		&& profile[0].bytes == 100 * sizeof(int)
+		&& profile[0].type == typeid(int).name()
+		&& "profile should show only the surviving ints");
+
+	v.clear();
+	heap.set_allocation_sampling(sizeof(int) * 10);
+	allocate_kept(heap, v);
+	heap.collect();
+
+	profile = heap.allocation_profile();
+	Expects(profile.size() == 1 && profile[0].samples == 10
+		&& profile[0].bytes == 100 * sizeof(int)
+		&& "sampling should estimate the surviving bytes");
+	cout << "site " << profile[0].site << " has " << profile[0].bytes 
+		 << " live bytes of " << profile[0].type << "\n";
+
+	//	two call sites of the same type, even in the same function, are
+	//	profiled separately
+	v.clear();
+	heap.collect();
+	heap.set_allocation_sampling(1);
+	for (int i = 0; i < 300; ++i) {
+		v.push_back(heap.make<int>(i));
+	}
+	for (int i = 0; i < 100; ++i) {
+		v.push_back(heap.make<int>(i));
+	}
+	heap.collect();
+
+	profile = heap.allocation_profile();
+	Expects(profile.size() == 2 && profile[0].site != profile[1].site
+		&& profile[0].samples == 300 && profile[1].samples == 100
+		&& "profile should show each call site with its own share");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Checked pointer arithmetic caches the allocation's bounds.
+//
+//----------------------------------------------------------------------------
+
+void test_checked_iteration() {
+	deferred_heap heap;
+
+	//	lots of pages, so that looking up the allocation would be slow
+	vector<deferred_ptr<int>> other;
+	for (int i = 0; i < 200; ++i) {
+		other.push_back(heap.make_array<int>(4096));
+	}
+
+	const int N = 100000;
+	auto a = heap.make_array<int>(N);
+	for (int i = 0; i < N; ++i) {
+		a[i] = i;
+	}
+
+	long long sum = 0;
+	auto end = a + N;	// one past the end is in the allocation
+	for (auto p = a; p != end; ++p) {
+		sum += *p;
+	}
+	Expects(sum == (long long)N * (N - 1) / 2 && "wrong iteration");
+	Expects(end - a == N && (end - 1) - a == N - 1 && "wrong pointer difference");
+
+	//	a single object: one past it, and back
+	auto one = heap.make<int>(7);
+	auto past = one + 1;
+	Expects(past - one == 1 && *(past - 1) == 7 && "wrong single-object arithmetic");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Algorithms over a deferred_span don't register their iterators.
+//
+//----------------------------------------------------------------------------
+
+void test_deferred_span() {
+	deferred_heap heap;
+	deferred_ptr<int> p;
+
+	{
+		auto v = deferred_vector<int>(heap);
+		for (int i = 0; i < 1000; ++i) {
+			v.push_back((i * 7919) % 1000);
+		}
+
+		auto span = deferred_span<int>(v);
+		auto roots = heap.stats().roots;
+		std::sort(span.begin(), span.end());
+		auto found = std::find(span.begin(), span.end(), 500);
+		Expects(heap.stats().roots == roots && "span iterators must not register");
+		Expects(std::is_sorted(v.begin(), v.end()) && found - span.begin() == 500
+			&& "wrong results through the span");
+
+		//	a stored iterator becomes a deferred_ptr, which keeps the buffer alive
+		p = span.to_deferred(found);
+	}
+	heap.collect();
+	Expects(*p == 500 && p[1] == 501 && "to_deferred didn't keep the buffer alive");
+
+	//	a span of an array keeps it alive by itself
+	auto a = heap.make_array<int>(10);
+	auto span2 = deferred_span<int>(a, 10);
+	a = nullptr;
+	heap.collect();
+	std::fill(span2.begin(), span2.end(), 42);
+	Expects(span2.subspan(2, 3).size() == 3 && span2[9] == 42 && "wrong array span");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Arrays cost one allocation and one destructor record.
+//
+//----------------------------------------------------------------------------
+
+//	Throws from the constructor of the third one made after 'made' is reset
+struct fragile {
+	static int made;
+	fragile(int value) {
+		if (++made == 3) {
+			throw value;
+		}
+	}
+	~fragile() { ++counted::destroyed; }
+};
+int fragile::made = 0;
+
+void test_make_array_variants() {
+	deferred_heap heap;
+	counted::destroyed = 0;
+
+	{
+		auto a = heap.make_array<counted>(5, 7);
+		for (int i = 0; i < 5; ++i) {
+			Expects(a[i].value == 7 && "make_array didn't construct every element");
+		}
+		a[0].value = 1;
+		Expects(a[1].value == 7 && "make_array constructed elements in the same place");
+		Expects(heap.stats().pending_destructors == 5 && "wrong destructor count");
+
+		auto b = heap.make_array_uninitialized<int>(1000000);
+		std::fill_n(b.get(), 1000000, 42);
+		Expects(heap.stats().pending_destructors == 5 && "uninitialized arrays need no destructors");
+
+		vector<string> strings{ "a", "bb", "ccc" };
+		auto c = heap.make_array_from(strings);
+		Expects(c[0] == "a" && c[2] == "ccc" && "make_array_from didn't copy the range");
+		Expects(heap.stats().pending_destructors == 8 && "wrong destructor count");
+	}
+	heap.collect();
+	Expects(counted::destroyed == 5 && heap.stats().pending_destructors == 0
+		&& "array elements were not all destroyed");
+
+	//	an empty range makes a null pointer, not an empty allocation
+	Expects(!heap.make_array_from(vector<string>{}) && "empty range should give null");
+
+	//	if an element's constructor throws, the ones already made are destroyed
+	counted::destroyed = 0;
+	try {
+		heap.make_array<fragile>(5, 42);
+		Expects(!"make_array should have thrown");
+	}
+	catch (int) {
+	}
+	Expects(counted::destroyed == 2 && heap.stats().pending_destructors == 0
+		&& "constructed elements were not destroyed after a throw");
+
+	//	destroying part of an array splits its destructor record
+	alignas(counted) unsigned char buf[10 * sizeof(counted)];
+	auto objs = (counted*)buf;
+	for (int i = 0; i < 10; ++i) {
+		::new (objs + i) counted{};
+	}
+	counted::destroyed = 0;
+	destructors d;
+	d.store(gsl::span<counted>(objs, 10));
+	d.run({ (gcpp::byte*)(objs + 3), 3 * (int)sizeof(counted) });
+	Expects(counted::destroyed == 3 && d.size() == 7 && d.is_stored<counted>(objs + 2)
+		&& d.is_stored<counted>(objs + 6) && !d.is_stored<counted>(objs + 4) && "wrong partial destruction");
+	d.run_all();
+	Expects(counted::destroyed == 10 && d.size() == 0 && "wrong remaining destruction");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	gpage_allocator as a non-collected pool for std:: containers.
+//
+//----------------------------------------------------------------------------
+
+void test_gpage_allocator() {
+	gpage_arena arena{ 256 };
+	gpage_arena other;
+
+	vector<int, gpage_allocator<int>> v{ gpage_allocator<int>{arena} };
+	for (int i = 0; i < 1000; ++i) {
+		v.push_back(i);
+	}
+	Expects(v[999] == 999 && arena.page_count() > 1 && "arena didn't grow");
+
+	set<int, less<int>, gpage_allocator<int>> s{ gpage_allocator<int>{arena} };
+	for (int i = 0; i < 100; ++i) {
+		s.insert(i);
+	}
+	Expects(s.size() == 100 && "set in arena lost elements");
+
+	Expects(gpage_allocator<int>{arena} == gpage_allocator<double>{arena}
+		&& gpage_allocator<int>{arena} != gpage_allocator<int>{other}
+		&& "allocators should be equal exactly when sharing an arena");
+
+	s.clear();
+	v.clear();
+	v.shrink_to_fit();
+	Expects(arena.allocations() == 0 && other.allocations() == 0 && "arena leaked");
+
+	//	space freed in an older page is reused before a new page is added
+	vector<long*> ps;
+	for (int i = 0; i < 1000; ++i) {
+		ps.push_back(other.allocate<long>());
+	}
+	auto pages = other.page_count();
+	for (int i = 0; i < 100; ++i) {
+		other.deallocate(ps[i]);
+	}
+	for (int i = 0; i < 100; ++i) {
+		ps[i] = other.allocate<long>();
+	}
+	Expects(other.page_count() == pages && "freed space wasn't reused");
+	for (auto p : ps) {
+		other.deallocate(p);
+	}
+	Expects(other.allocations() == 0 && "arena leaked");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	gpage and deferred_heap as std::pmr::memory_resources.
+//
+//----------------------------------------------------------------------------
+
+void test_memory_resource() {
+	gpage_resource pool{ 256 };
+	{
+		std::pmr::vector<int> v{ &pool };
+		std::pmr::list<double> l{ &pool };
+		for (int i = 0; i < 1000; ++i) {
+			v.push_back(i);
+			l.push_back(i * 1.0);
+		}
+		Expects(v[999] == 999 && l.back() == 999.0 && "pmr containers lost elements");
+
+		auto p = pool.allocate(100, 64);
+		Expects((reinterpret_cast<std::uintptr_t>(p) % 64) == 0 && "misaligned allocation");
+		pool.deallocate(p, 100, 64);
+	}
+	Expects(pool.arena().allocations() == 0 && "gpage_resource leaked");
+
+	deferred_heap heap;
+	{
+		deferred_heap_resource r{ heap };
+		std::pmr::vector<int> v{ &r };
+		for (int i = 0; i < 1000; ++i) {
+			v.push_back(i);
+		}
+		heap.collect();
+		Expects(v[999] == 999 && r.pinned() == 1 && "pinned storage was collected");
+	}
+	heap.collect();
+	Expects(heap.stats().live_allocations == 0 && "deferred_heap_resource leaked");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Over-aligned allocations, including alignments that are not multiples
+//	of the page's location size.
+//
+//----------------------------------------------------------------------------
+
+struct alignas(64) cache_line_counter { long value = 0; };
+struct alignas(32) simd_block { float f[8]; };
+
+void test_aligned_allocation() {
+	auto aligned = [](const void* p, std::size_t a) {
+		return reinterpret_cast<std::uintptr_t>(p) % a == 0;
+	};
+
+	gpage g{ 16384, 12 };
+	for (int i = 0; i < 20; ++i) {
+		auto c = g.allocate<char>();
+		auto d = g.allocate<double>(i % 3 + 1);
+		auto s = g.allocate<simd_block>();
+		auto l = g.allocate<cache_line_counter>(2);
+		Expects(c && d && s && l && "page should have room");
+		Expects(aligned(d, alignof(double)) && aligned(s, 32) && aligned(l, 64)
+			&& "misaligned allocation");
+		if (i % 2) {
+			g.deallocate(c);
+			g.deallocate(s);
+		}
+	}
+
+	deferred_heap heap;
+	vector<deferred_ptr<cache_line_counter>> v;
+	for (int i = 0; i < 100; ++i) {
+		v.push_back(heap.make<cache_line_counter>());
+		heap.make<char>();
+		Expects(aligned(v.back().get(), 64) && "misaligned deferred allocation");
+	}
+
+	gpage_arena arena;
+	auto p = arena.allocate_bytes(100, 4096);
+	Expects(aligned(p, 4096) && "alignment above the page's storage alignment failed");
+	arena.deallocate(p);
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	NUMA-aware page placement. On a single-node machine every page is on
+//	node 0, so this mainly checks that placement doesn't disturb collection
+//	and compaction.
+//
+//----------------------------------------------------------------------------
+
+void test_numa_pages() {
+	cout << "this thread is on NUMA node " << current_numa_node() << "\n";
+
+	deferred_heap heap;
+	heap.set_numa_aware(true);
+	heap.set_page_storage(gpage_storage::mapped);
+	heap.set_compaction(true);
+
+	vector<deferred_ptr<compact_node>> v;
+	for (int i = 0; i < 2000; ++i) {
+		v.push_back(heap.make<compact_node>());
+		v.back()->value = i;
+	}
+	for (size_t i = 0; i + 1 < v.size(); ++i) {
+		v[i]->next = v[i + 1];
+	}
+	auto first = v.front();
+	v.clear();
+	heap.collect();
+	Expects(compact_node::live == 2000 && "reachable nodes were collected");
+
+	first->next->next = nullptr;
+	heap.compact();
+	Expects(compact_node::live == 2 && first->value == 0 && first->next->value == 1
+		&& "NUMA-aware compaction corrupted objects");
+
+	first = nullptr;
+	heap.collect();
+	Expects(compact_node::live == 0 && "nodes were not destroyed");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Region-style use: reset() frees everything per "request", and later
+//	requests reuse the same pages.
+//
+//----------------------------------------------------------------------------
+
+void test_heap_reset() {
+	deferred_heap heap;
+	deferred_ptr<compact_node> keep;
+	size_t pages = 0;
+
+	for (int request = 0; request < 5; ++request) {
+		counted::destroyed = 0;
+		auto first = heap.make<compact_node>();
+		auto last = first;
+		for (int i = 0; i < 500; ++i) {
+			last->next = heap.make<compact_node>();
+			last = last->next;
+			heap.make<counted>();
+		}
+		last->next = first;	// a cycle, which reset() must break too
+		keep = first;
+
+		heap.reset();
+		Expects(keep == nullptr && first == nullptr && last == nullptr
+			&& "reset() didn't null every deferred_ptr");
+		Expects(compact_node::live == 0 && counted::destroyed == 500
+			&& "reset() didn't run every destructor");
+
+		auto stats = heap.stats();
+		Expects(stats.live_allocations == 0 && stats.pending_destructors == 0
+			&& "reset() didn't empty the pages");
+		if (request == 0) {
+			pages = stats.pages;
+		}
+		Expects(stats.pages == pages && "reset() should keep, and reuse, the pages");
+	}
+
+	//	In a thread-safe heap, reset() while another thread is collecting
+	//	waits its turn instead of silently doing nothing
+	//
+	deferred_heap shared;
+	shared.set_thread_safe(true);
+	bool done = false;	// guarded by m
+	std::mutex m;
+	thread collector{ [&] {
+		shared.attach_thread();
+		for (;;) {
+			{
+				lock_guard<std::mutex> hold(m);
+				if (done) break;
+			}
+			shared.collect();
+		}
+		shared.detach_thread();
+	} };
+	for (int request = 0; request < 2000; ++request) {
+		auto p = shared.make<counted>();
+		shared.make<counted>();
+		shared.reset();
+		Expects(p == nullptr && "reset() lost its turn to a collection");
+		Expects(shared.stats().live_allocations == 0 && "reset() left allocations behind");
+	}
+	{
+		lock_guard<std::mutex> hold(m);
+		done = true;
+	}
+	collector.join();
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Each page counts its pending destructors, so that pages with none are
+//	skipped without scanning the records.
+//
+//----------------------------------------------------------------------------
+
+void test_destructor_counts() {
+	alignas(counted) unsigned char buf[20 * sizeof(counted)];
+	auto objs = (counted*)buf;
+	auto range = [&](int from, int to) {
+		return gsl::span<gcpp::byte>{ (gcpp::byte*)(objs + from), (to - from) * (int)sizeof(counted) };
+	};
+
+	destructors d;
+	Expects(d.run(range(0, 20)) == 0 && "empty destructors destroy nothing");
+
+	for (int i = 5; i < 10; ++i) {
+		::new (objs + i) counted{};
+	}
+	d.store(gsl::span<counted>(objs + 5, 5));
+
+	counted::destroyed = 0;
+	Expects(d.run(range(10, 20)) == 0 && counted::destroyed == 0 && "ran a destructor out of range");
+	Expects(d.run(range(8, 20)) == 2 && counted::destroyed == 2 && "wrong number of destructors run");
+	Expects(d.run(range(0, 20)) == 3 && counted::destroyed == 5 && "didn't run the destructors");
+	Expects(d.size() == 0 && "destructors left behind");
+
+	//	a heap of trivially destructible objects never registers any
+	deferred_heap heap;
+	for (int i = 0; i < 1000; ++i) {
+		heap.make<int>(i);
+	}
+	Expects(heap.stats().pending_destructors == 0 && "trivial objects need no destructors");
+	heap.collect();
+	Expects(heap.stats().live_allocations == 0 && "trivial objects were not swept");
+
+	//	mixing the two, and moving them, keeps every page's count right
+	//	(which verify() checks) and still runs every destructor
+	heap.set_compaction(true);
+	counted::destroyed = 0;
+	vector<deferred_ptr<counted>> keep;
+	for (int i = 0; i < 1000; ++i) {
+		heap.make<int>(i);
+		auto p = heap.make<counted>();
+		if (i % 10 == 0) {
+			keep.push_back(p);
+		}
+		heap.make_array<counted>(3);
+	}
+	Expects(heap.verify() == nullptr && "destructor counts wrong after allocating");
+	heap.collect();
+	Expects(counted::destroyed == 900 + 3000 && heap.stats().pending_destructors == 100
+		&& "sweep missed a destructor");
+	heap.compact();	// which destroys each moved-from object
+	Expects(heap.stats().pending_destructors == 100 && "compaction lost a destructor");
+	Expects(heap.verify() == nullptr && "destructor counts wrong after compacting");
+	auto before = counted::destroyed;
+	Expects(before > 900 + 3000 && "compaction moved nothing");
+	keep.clear();
+	heap.collect();
+	Expects(counted::destroyed == before + 100 && heap.stats().pending_destructors == 0
+		&& "destructors lost track of moved objects");
+	Expects(heap.verify() == nullptr && "destructor counts wrong after sweeping");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	Weak pointers: a cache that doesn't keep its entries alive.
+//
+//----------------------------------------------------------------------------
+
+struct observed {
+	deferred_weak_ptr<observed> self;
+	deferred_ptr<observed> next;
+	int value = 0;
+};
+
+void test_weak_ptr() {
+	deferred_heap heap;
+	heap.set_compaction(true);
+
+	vector<deferred_weak_ptr<observed>> cache;
+	vector<deferred_ptr<observed>> keep;
+	for (int i = 0; i < 1000; ++i) {
+		auto p = heap.make<observed>();
+		p->value = i;
+		p->self = p;
+		p->next = p;	// a cycle, which weak pointers must not keep alive
+		cache.push_back(p);
+		if (i % 10 == 0) {
+			keep.push_back(p);
+		}
+	}
+	Expects(heap.stats().weak_pointers == 2000 && "weak pointers not registered");
+
+	heap.compact();	// collects, and moves the survivors together
+	for (int i = 0; i < 1000; ++i) {
+		auto p = cache[i].lock();
+		Expects((p != nullptr) == (i % 10 == 0) && "weak pointer wrongly nulled or kept");
+		Expects((p == nullptr || (p->value == i && p->self.lock() == p))
+			&& "weak pointer not updated by compaction");
+	}
+	Expects(heap.stats().weak_pointers == 1000 + keep.size()
+		&& "weak pointers in collected objects not deregistered");
+
+	//	locking during an incremental collection keeps the object alive
+	deferred_weak_ptr<observed> w = keep.back();
+	keep.clear();
+	auto anchor = heap.make<observed>();
+	anchor->next = heap.make<observed>();	// so that marking takes a step
+	Expects(!heap.collect_step(0) && "marking should be in progress");
+	auto locked = w.lock();
+	heap.collect();
+	Expects(!w.expired() && locked->value == 990 && "object locked during marking was collected");
+
+	locked = nullptr;
+	heap.collect();
+	Expects(w.expired() && w.lock() == nullptr && "unreachable object still observed");
+
+	auto p = heap.make<observed>();
+	w = p;
+	heap.reset();
+	Expects(w.expired() && "reset() didn't null weak pointers");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	A memoization table whose entries live exactly as long as their keys,
+//	even when a value refers back to its key.
+//
+//----------------------------------------------------------------------------
+
+//	An object that uses a map while compaction moves it
+struct map_reader {
+	static deferred_weak_map<compact_node, compact_node>* memo;
+	map_reader() = default;
+	map_reader(map_reader&&) noexcept { memo->size(); }
+};
+deferred_weak_map<compact_node, compact_node>* map_reader::memo = nullptr;
+
+void test_deferred_weak_map() {
+	deferred_heap heap;
+	heap.set_compaction(true);
+	deferred_weak_map<compact_node, compact_node> memo{ heap };
+
+	vector<deferred_ptr<compact_node>> keys;
+	for (int i = 0; i < 100; ++i) {
+		auto key = heap.make<compact_node>();
+		key->value = i;
+		auto value = heap.make<compact_node>();
+		value->value = i * i;
+		value->next = key;	// a value that keeps its own key alive
+		memo.insert_or_assign(key, value);
+		keys.push_back(key);
+	}
+
+	//	a chain: the value of k1 is the key k2, whose value is only reachable
+	//	through the map, so it must survive for as long as k1 does
+	auto k1 = heap.make<compact_node>();
+	auto k2 = heap.make<compact_node>();
+	auto v2 = heap.make<compact_node>();
+	v2->value = 42;
+	memo.insert_or_assign(k1, k2);
+	memo.insert_or_assign(k2, v2);
+	k2 = nullptr;
+	v2 = nullptr;
+
+	//	drop the odd keys
+	for (int i = 1; i < 100; i += 2) {
+		keys[i] = nullptr;
+	}
+	heap.compact();
+
+	Expects(memo.size() == 52 && "wrong entries survived");
+	Expects(compact_node::live == 50 * 2 + 3 && "values of dead keys were kept alive");
+	for (int i = 0; i < 100; i += 2) {
+		auto v = memo.find(keys[i]);
+		Expects(v != nullptr && v->value == i * i && v->next == keys[i]
+			&& "a live key's value was lost or not updated by compaction");
+	}
+	Expects(memo.find(memo.find(k1))->value == 42 && "a chained value was lost");
+
+	keys.clear();
+	k1 = nullptr;
+	heap.collect();
+	Expects(memo.empty() && compact_node::live == 0 && "entries outlived their keys");
+
+	//	a map used while compaction is moving its keys (here by a move
+	//	constructor, after the collection has finished) must still find
+	//	them afterwards
+	map_reader::memo = &memo;
+	vector<deferred_ptr<map_reader>> readers;
+	for (int i = 0; i < 100; ++i) {
+		auto key = heap.make<compact_node>();
+		memo.insert_or_assign(key, heap.make<compact_node>());
+		keys.push_back(key);
+		readers.push_back(heap.make<map_reader>());
+	}
+	for (int i = 0; i < 100; i += 2) {
+		keys[i] = nullptr;
+		readers[i] = nullptr;
+	}
+	heap.compact();
+	for (int i = 1; i < 100; i += 2) {
+		Expects(memo.find(keys[i]) != nullptr && "the map lost track of a moved key");
+	}
+	keys.clear();
+	readers.clear();
+	heap.collect();
+	Expects(memo.empty() && "entries outlived their keys");
+
+	//	an ephemeron stored in the heap keeps its value alive only while the
+	//	object holding it is reachable too, even if its key lives on
+	struct holder {
+		deferred_ephemeron<compact_node, compact_node> e;
+		holder(deferred_heap& h) : e{ h } { }
+	};
+	auto key = heap.make<compact_node>();
+	auto kept = heap.make<holder>(heap);
+	kept->e.set(key, heap.make<compact_node>());
+	heap.make<holder>(heap)->e.set(key, heap.make<compact_node>());	// garbage
+	heap.collect();
+	Expects(compact_node::live == 2 && kept->e.value() != nullptr
+		&& "an unreachable ephemeron kept its value alive");
+	kept = nullptr;
+	heap.collect();
+	Expects(compact_node::live == 1 && "an unreachable ephemeron kept its value alive");
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	verify() finds a consistent heap at every stage of its life.
+//
+//----------------------------------------------------------------------------
+
+void test_heap_verify() {
+	deferred_heap heap;
+	heap.set_compaction(true);
+	Expects(heap.verify() == nullptr && "an empty heap is inconsistent");
+
+	//	enough pages to be checked in parallel, with interior pointers,
+	//	arrays, pointers into the middle of arrays, and destructors
+	vector<deferred_ptr<compact_node>> roots;
+	for (int i = 0; i < 2000; ++i) {
+		auto n = heap.make<compact_node>();
+		n->next = heap.make<compact_node>();
+		n->next->next = n;
+		roots.push_back(n);
+	}
+	auto arr = heap.make_array<counted>(100);
+	auto mid = arr + 50;
+	Expects(heap.verify() == nullptr && "a heap in use is inconsistent");
+
+	for (int i = 0; i < 2000; i += 2) {
+		roots[i] = nullptr;
+	}
+	arr = nullptr;
+	heap.collect_step(10);
+	Expects(heap.verify() == nullptr && "a heap being marked is inconsistent");
+
+	heap.compact();
+	Expects(heap.stats().pages > 1 && heap.verify() == nullptr
+		&& "a compacted heap is inconsistent");
+
+	heap.reset();
+	Expects(heap.verify() == nullptr && "a reset heap is inconsistent");
+}
+
+
+int main() {
+	//test_page();
+
+	test_deferred_heap();
+
+	//test_deferred_allocator();
+
+	//test_deferred_allocator_set();
+
+	//test_deferred_allocator_vector();
+
+	//test_deferred_array();
+
+	//test_shrink_to_fit();
+	//test_mapped_pages();
+	//test_thread_safe_heap();
+	//test_thread_local_buffers();
+	//test_incremental_collect();
+	//test_background_collection();
+	//test_generational();
+	//test_generational_footprint();
+	//test_compact();
+	//test_collect_policy();
+	//test_heap_stats();
+	//test_collect_trace();
+	//test_allocation_profile();
+	//test_checked_iteration();
+	//test_deferred_span();
+	//test_make_array_variants();
+	//test_gpage_allocator();
+	//test_memory_resource();
+	//test_aligned_allocation();
+	//test_numa_pages();
+	//test_heap_reset();
+	//test_destructor_counts();
+	//test_weak_ptr();
+	//test_deferred_weak_map();
+	//test_heap_verify();
 
 	//heap.collect();
 	//heap.debug_print();
@@ -4,9 +4,17 @@ using namespace gcpp;
 
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <string>
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <random>
+#include <chrono>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 using namespace std;
 
 
@@ -141,6 +149,221 @@ bool TestCase3() {
 	return Counter::count() == 4;
 }
 
+
+
+//----------------------------------------------------------------------------
+//
+//	Workloads: The same graphs built with deferred_ptr and with a shared_ptr
+//	baseline (which needs weak_ptr for the edges that would form cycles), to
+//	measure the collector at scale. Each shape is generated as a list of
+//	edges between node numbers; node 0 is the only root, and reaches every
+//	other node through forward edges (from a lower to a higher number).
+//
+//	RandomDag	each node gets a random earlier parent, plus 'degree'-1
+//				more random forward edges
+//	DeepList	a single chain
+//	WideTree	each node has 'degree' children
+//	Cyclic		a random tree whose nodes each also point 'degree' edges
+//				back at random earlier nodes
+//
+//----------------------------------------------------------------------------
+
+enum class Shape { RandomDag, DeepList, WideTree, Cyclic };
+
+const char* ShapeName(Shape shape) {
+	switch (shape) {
+	case Shape::RandomDag: return "random DAG";
+	case Shape::DeepList:  return "deep list";
+	case Shape::WideTree:  return "wide tree";
+	default:               return "cyclic";
+	}
+}
+
+struct Edge { int from, to; };
+
+vector<Edge> GenerateEdges(Shape shape, int nodes, int degree, unsigned seed = 42) {
+	vector<Edge> edges;
+	mt19937 gen{ seed };
+	auto earlier = [&](int i) { return uniform_int_distribution<int>{ 0, i - 1 }(gen); };
+
+	for (int i = 1; i < nodes; ++i) {
+		switch (shape) {
+		case Shape::RandomDag:
+			edges.push_back({ earlier(i), i });
+			for (int d = 1; d < degree; ++d) {
+				auto from = earlier(i);
+				edges.push_back({ from, from + 1 + earlier(i - from) });
+			}
+			break;
+		case Shape::DeepList:
+			edges.push_back({ i - 1, i });
+			break;
+		case Shape::WideTree:
+			edges.push_back({ (i - 1) / degree, i });
+			break;
+		case Shape::Cyclic:
+			edges.push_back({ earlier(i), i });
+			for (int d = 0; d < degree; ++d) {
+				edges.push_back({ i, earlier(i + 1) });	// back edge (or self-loop)
+			}
+			break;
+		}
+	}
+	return edges;
+}
+
+//	Memory use of the whole process, from Linux's /proc; 0 elsewhere
+//
+static size_t RssKb(const char* field) {
+	ifstream status{ "/proc/self/status" };
+	string word;
+	size_t kb = 0;
+	while (status >> word) {
+		if (word == field) {
+			status >> kb;
+			break;
+		}
+	}
+	return kb;
+}
+
+
+struct WorkloadResult {
+	double build_ms = 0;
+	double collect_ms = 0;		// deferred: collect() with the graph reachable
+	double reclaim_ms = 0;		// drop the root, and reclaim everything
+	size_t peak_kb = 0;			// peak process RSS during the workload
+	double bytes_per_node = 0;	// RSS growth from building the graph
+};
+
+template<class F>
+static double TimeMs(F f) {
+	auto start = chrono::steady_clock::now();
+	f();
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+WorkloadResult RunShared(int nodes, const vector<Edge>& edges) {
+	struct SharedNode {
+		vector<shared_ptr<SharedNode>> children;
+		vector<weak_ptr<SharedNode>>   back;
+	};
+
+	WorkloadResult r;
+	auto rss_before = RssKb("VmRSS:");
+
+	vector<shared_ptr<SharedNode>> all;	// for building only
+	shared_ptr<SharedNode> root;
+	r.build_ms = TimeMs([&] {
+		for (int i = 0; i < nodes; ++i) {
+			all.push_back(make_shared<SharedNode>());
+		}
+		for (auto& e : edges) {
+			if (e.from < e.to) {
+				all[e.from]->children.push_back(all[e.to]);
+			}
+			else {
+				all[e.from]->back.push_back(all[e.to]);
+			}
+		}
+		root = all[0];
+		all.clear();
+	});
+	r.bytes_per_node = (RssKb("VmRSS:") - rss_before) * 1024.0 / nodes;
+
+	//	drop the root; destroy deep graphs from the leaves up, to avoid
+	//	overflowing the stack with recursive destructors
+	r.reclaim_ms = TimeMs([&] {
+		vector<shared_ptr<SharedNode>> pending{ std::move(root) };
+		while (!pending.empty()) {
+			auto p = std::move(pending.back());
+			pending.pop_back();
+			if (p.use_count() == 1) {
+				for (auto& c : p->children) {
+					pending.push_back(std::move(c));
+				}
+			}
+		}
+	});
+	r.peak_kb = RssKb("VmHWM:") - rss_before;
+	return r;
+}
+
+WorkloadResult RunDeferred(int nodes, const vector<Edge>& edges) {
+	deferred_heap heap;
+
+	struct DeferredNode {
+		deferred_vector<deferred_ptr<DeferredNode>> children;
+		DeferredNode(deferred_heap& h) : children{ h } { }
+	};
+
+	WorkloadResult r;
+	auto rss_before = RssKb("VmRSS:");
+
+	vector<deferred_ptr<DeferredNode>> all;	// for building only
+	deferred_ptr<DeferredNode> root;
+	r.build_ms = TimeMs([&] {
+		for (int i = 0; i < nodes; ++i) {
+			all.push_back(heap.make<DeferredNode>(heap));
+		}
+		for (auto& e : edges) {
+			all[e.from]->children.push_back(all[e.to]);
+		}
+		root = all[0];
+		all.clear();
+	});
+	r.bytes_per_node = (RssKb("VmRSS:") - rss_before) * 1024.0 / nodes;
+
+	r.collect_ms = TimeMs([&] { heap.collect(); });
+	r.reclaim_ms = TimeMs([&] { root.reset(); heap.collect(); });
+	r.peak_kb = RssKb("VmHWM:") - rss_before;
+	return r;
+}
+
+//	Run a workload in a child process where possible, so that its memory
+//	measurements don't include memory that earlier workloads freed
+//
+template<class F>
+WorkloadResult Isolated(F f) {
+#if defined(__unix__) || defined(__APPLE__)
+	int fds[2];
+	if (pipe(fds) == 0) {
+		auto pid = fork();
+		if (pid == 0) {
+			auto r = f();
+			auto written = write(fds[1], &r, sizeof(r));
+			_exit(written == sizeof(r) ? 0 : 1);
+		}
+		WorkloadResult r;
+		auto got = read(fds[0], &r, sizeof(r));
+		close(fds[0]);
+		close(fds[1]);
+		waitpid(pid, nullptr, 0);
+		Expects(got == sizeof(r) && "workload process failed");
+		return r;
+	}
+#endif
+	return f();
+}
+
+void RunWorkloads(int nodes, int degree = 4) {
+	cout << "\n" << nodes << " nodes, degree " << degree << "\n"
+		 << setw(12) << "shape" << setw(10) << "pointer" << setw(12) << "build ms"
+		 << setw(12) << "collect ms" << setw(12) << "reclaim ms"
+		 << setw(12) << "peak KB" << setw(12) << "bytes/node" << "\n"
+		 << fixed << setprecision(1);
+
+	for (auto shape : { Shape::RandomDag, Shape::DeepList, Shape::WideTree, Shape::Cyclic }) {
+		auto print = [&](const char* kind, const WorkloadResult& r) {
+			cout << setw(12) << ShapeName(shape) << setw(10) << kind << setw(12) << r.build_ms
+				 << setw(12) << r.collect_ms << setw(12) << r.reclaim_ms
+				 << setw(12) << r.peak_kb << setw(12) << r.bytes_per_node << "\n";
+		};
+		print("shared", Isolated([=] { return RunShared(nodes, GenerateEdges(shape, nodes, degree)); }));
+		print("deferred", Isolated([=] { return RunDeferred(nodes, GenerateEdges(shape, nodes, degree)); }));
+	}
+}
+
 int _main() {
 	cout.setf(ios::boolalpha);
 
@@ -153,5 +376,9 @@ int _main() {
 	bool passed3 = TestCase3();
 	cout << passed3 << endl;
 
+	//	Scale these up (e.g., to 1 << 20) to check the collector's scaling
+	//RunWorkloads(1 << 12);
+	//RunWorkloads(1 << 16);
+
 	return 0;
 }
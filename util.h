@@ -27,12 +27,94 @@
 //	This project requires GSL, see: https://github.com/microsoft/gsl
 #include <gsl/gsl>
 
+//	Contract checks. GCPP_CONTRACT_LEVEL selects which ones are compiled in:
+//
+//	GCPP_CONTRACT_OFF		none, for release builds that want no overhead
+//	GCPP_CONTRACT_DEFAULT	GCPP_EXPECTS, the checks that are cheap relative
+//							to the operation they guard (this is the default)
+//	GCPP_CONTRACT_AUDIT		also GCPP_AUDIT, the checks on the hottest paths
+//							(e.g., every bitflags access) and those that scan
+//
+//	A failed check is reported as GSL's Expects reports it. A check that is
+//	compiled out does not evaluate its condition.
+//
+#define GCPP_CONTRACT_OFF		0
+#define GCPP_CONTRACT_DEFAULT	1
+#define GCPP_CONTRACT_AUDIT		2
+
+#ifndef GCPP_CONTRACT_LEVEL
+#define GCPP_CONTRACT_LEVEL GCPP_CONTRACT_DEFAULT
+#endif
+
+#define GCPP_CONTRACT_IGNORE(cond) ((void)sizeof(!(cond)))
+
+#if GCPP_CONTRACT_LEVEL >= GCPP_CONTRACT_DEFAULT
+#define GCPP_EXPECTS(cond) Expects(cond)
+#else
+#define GCPP_EXPECTS(cond) GCPP_CONTRACT_IGNORE(cond)
+#endif
+
+#if GCPP_CONTRACT_LEVEL >= GCPP_CONTRACT_AUDIT
+#define GCPP_AUDIT(cond) Expects(cond)
+#else
+#define GCPP_AUDIT(cond) GCPP_CONTRACT_IGNORE(cond)
+#endif
+
 namespace gcpp {
 
 	using byte = gsl::byte;
 
+	namespace detail {
+
+		//	A unit of storage with a given power-of-two alignment, used as the
+		//	type hint when the size and alignment of an allocation are only
+		//	known at run time (e.g., for a std::pmr::memory_resource)
+		//
+		template<std::size_t Align>
+		struct alignas(Align) aligned_unit {
+			byte data[Align];
+		};
+
+		//	Call f((aligned_unit<A>*)nullptr) for the smallest supported A that
+		//	is at least align, which must be a power of two no more than 4096
+		//
+		template<class F>
+		auto with_aligned_unit(std::size_t align, F f) {
+			GCPP_EXPECTS(align > 0 && (align & (align - 1)) == 0 && "alignment must be a power of two");
+			if (align <= 1)		return f((aligned_unit<1>*)nullptr);
+			if (align <= 2)		return f((aligned_unit<2>*)nullptr);
+			if (align <= 4)		return f((aligned_unit<4>*)nullptr);
+			if (align <= 8)		return f((aligned_unit<8>*)nullptr);
+			if (align <= 16)	return f((aligned_unit<16>*)nullptr);
+			if (align <= 32)	return f((aligned_unit<32>*)nullptr);
+			if (align <= 64)	return f((aligned_unit<64>*)nullptr);
+			if (align <= 128)	return f((aligned_unit<128>*)nullptr);
+			if (align <= 256)	return f((aligned_unit<256>*)nullptr);
+			if (align <= 512)	return f((aligned_unit<512>*)nullptr);
+			if (align <= 1024)	return f((aligned_unit<1024>*)nullptr);
+			if (align <= 2048)	return f((aligned_unit<2048>*)nullptr);
+			GCPP_EXPECTS(align <= 4096 && "alignment not supported");
+			return f((aligned_unit<4096>*)nullptr);
+		}
+
+	}
+
 }
 
+//	The address that the current function will return to, and a way to keep
+//	a function from being inlined so that this is its caller's code
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GCPP_NOINLINE __declspec(noinline)
+#define GCPP_RETURN_ADDRESS() _ReturnAddress()
+#elif defined(__GNUC__) || defined(__clang__)
+#define GCPP_NOINLINE __attribute__((noinline))
+#define GCPP_RETURN_ADDRESS() __builtin_return_address(0)
+#else
+#define GCPP_NOINLINE
+#define GCPP_RETURN_ADDRESS() nullptr
+#endif
+
 //	This is the right way to do totally ordered comparisons
 //	TODO propose again in ISO (in the language, not as a macro of course)
 #define GCPP_TOTALLY_ORDERED_COMPARISON(Type) \